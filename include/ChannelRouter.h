@@ -0,0 +1,77 @@
+//
+// Created by 穆琰鑫 on 2024/10/27.
+//
+
+#ifndef HACK_CHAT_CHANNELROUTER_H
+#define HACK_CHAT_CHANNELROUTER_H
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * @brief 频道订阅路由表，维护频道到订阅者集合以及用户到已订阅频道的双向映射
+ *
+ * 一个用户可以同时订阅多个频道，同一频道重复订阅只记一次，
+ * 因此每条广播只为频道序列化一次，每个订阅者也只收到一份。
+ * 只在服务器 I/O 线程中使用，不加锁。
+ */
+class ChannelRouter {
+public:
+    using SubscriberSet = std::unordered_set<std::string>;
+
+    /**
+     * @brief 订阅频道，不会创建频道
+     * @param channel 频道名称，必须已经通过 add_channel 登记
+     * @param username 用户名
+     * @return 频道存在且之前未订阅时返回 true
+     */
+    bool subscribe(const std::string& channel, const std::string& username);
+
+    /**
+     * @brief 退订频道
+     * @param channel 频道名称
+     * @param username 用户名
+     * @return 之前已订阅时返回 true
+     */
+    bool unsubscribe(const std::string& channel, const std::string& username);
+
+    /**
+     * @brief 退订用户的所有频道
+     * @param username 用户名
+     * @return 被退订的频道
+     */
+    std::vector<std::string> unsubscribe_all(const std::string& username);
+
+    /**
+     * @brief 频道的订阅者
+     * @param channel 频道名称
+     * @return 订阅者集合，频道不存在时为空集合
+     */
+    const SubscriberSet& subscribers(const std::string& channel) const;
+
+    /**
+     * @brief 用户已订阅的频道
+     * @param username 用户名
+     * @return 频道名称，顺序不固定
+     */
+    std::vector<std::string> subscriptions(const std::string& username) const;
+
+    /**
+     * @brief 登记一个频道，使其在没有订阅者时也出现在路由表中
+     * @param channel 频道名称
+     */
+    void add_channel(const std::string& channel);
+
+    /**
+     * @brief 所有频道及其订阅者，用于平滑升级时导出状态
+     */
+    const std::unordered_map<std::string, SubscriberSet>& channels() const { return subscribers_; }
+
+private:
+    std::unordered_map<std::string, SubscriberSet> subscribers_;    ///< 频道到订阅者集合
+    std::unordered_map<std::string, SubscriberSet> subscriptions_;  ///< 用户到已订阅频道集合
+};
+
+#endif //HACK_CHAT_CHANNELROUTER_H
@@ -13,11 +13,15 @@
 #include "FL/Fl_Button.H"
 #include "FL/Fl_Hold_Browser.H"
 #include "FL/Fl_Text_Display.H"
+#include "FL/Fl_Tabs.H"
 #include "FL/Fl_Box.H"
+#include <map>
 #include <vector>
 #include <string>
 #include <iostream>
 #include <optional>
+#include <functional>
+#include <mutex>
 #include "NetWork.h"
 
 /// 封装客户端界面和逻辑的类
@@ -35,15 +39,31 @@ private:
     Fl_Hold_Browser* channel_browser;// 频道列表控件
 
     // chat_group 中的控件
-    Fl_Text_Display* chat_display;   // 聊天消息显示
+    Fl_Tabs* channel_tabs;           // 频道标签页，每个订阅的频道一页
     Fl_Input* chat_input;            // 聊天输入框
     Fl_Button* send_button;          // 发送按钮
     Fl_Button* return_button;        // 返回按钮
-    Fl_Text_Buffer* text_buffer;     // 聊天框的文本缓冲区
+    Fl_Button* leave_button;         // 退订当前频道按钮
+
+    /// 一个已订阅频道的标签页
+    struct ChannelTab {
+        Fl_Group* group;             // 标签页
+        Fl_Text_Display* display;    // 聊天消息显示
+        Fl_Text_Buffer* buffer;      // 聊天框的文本缓冲区
+        int unread = 0;              // 标签页不可见时收到的消息数
+    };
+    std::map<std::string, ChannelTab> channel_tabs_;  // 频道名到标签页，所有频道共用一个连接
 
     // 封装网络相关类
     std::unique_ptr<ClientNetwork> client_network_;
     std::thread io_thread_;  // 用于运行 io_context 的线程
+    double trace_sample_rate_ = 0;  // 延迟追踪采样率，每次连接时设置给网络模块
+    ConnectOptions connect_options_;  // 连接超时和重连参数，每次连接时设置给网络模块
+
+    // I/O 线程交给 GUI 线程执行的界面更新，界面控件和 channel_tabs_ 只在 GUI 线程访问
+    std::mutex gui_tasks_mutex_;
+    std::vector<std::function<void()>> gui_tasks_;
+    bool gui_tasks_posted_ = false;  // 是否已通过 Fl::awake 通知 GUI 线程
 
 public:
     ChatClientGUI(int width, int height, const char* title);
@@ -51,6 +71,14 @@ public:
     /// 显示窗口
     void show();
 
+    /// 设置延迟追踪采样率，之后的连接生效
+    /// \param rate 采样率，取值 0 到 1
+    void set_trace_sample_rate(double rate);
+
+    /// 设置连接超时、地址尝试错开时间和重连退避参数，之后的连接生效
+    /// \param options 连接参数
+    void set_connect_options(const ConnectOptions& options);
+
     /// 静态回调函数用于连接服务器
     /// \param w 控件指针
     /// \param data 数据
@@ -59,6 +87,10 @@ public:
     /// 连接服务器并更新频道列表
     void connect_server();
 
+    /// 在 GUI 线程执行 I/O 线程提交的界面更新
+    /// \param data ChatClientGUI 指针
+    static void gui_tasks_cb(void* data);
+
     /// 静态回调函数用于处理频道选择
     /// \param w 控件指针
     /// \param data 数据
@@ -77,10 +109,26 @@ public:
     /// \param data 数据
     static void send_cb(Fl_Widget* w, void* data);
 
-    /// 跳转到聊天界面
+    /// 跳转到聊天界面，并切换到频道的标签页，标签页不存在时先创建
     /// \param channel_name 跳转的频道名
     void switch_to_chat(const char* channel_name);
 
+    /// 静态回调函数用于处理标签页切换
+    /// \param w 控件指针
+    /// \param data 数据
+    static void tab_changed_cb(Fl_Widget* w, void* data);
+
+    /// 标签页切换处理逻辑，清零未读数并设为当前频道
+    void tab_changed();
+
+    /// 静态回调函数用于退订当前频道
+    /// \param w 控件指针
+    /// \param data 数据
+    static void leave_cb(Fl_Widget* w, void* data);
+
+    /// 退订当前频道并关闭其标签页
+    void leave_channel();
+
     /// 跳转到频道选择界面
     void switch_to_channel();
 
@@ -92,10 +140,31 @@ public:
 
      /**
      * @brief 显示从服务器接收到的消息。
-     * 此方法更新聊天界面的文本缓冲区以包含新消息。
+     * 此方法更新消息所属频道标签页的文本缓冲区，标签页不可见时累加未读数，只能在 GUI 线程调用。
+     * @param channel 消息所属的频道。
      * @param message 需要显示的消息文本。
      */
-     void display_message(const std::string& message);
+     void display_message(const std::string& channel, const std::string& message);
+
+private:
+    /// 从 I/O 线程提交界面更新，由 GUI 线程按提交顺序执行
+    /// \param task 界面更新
+    void post_to_gui(std::function<void()> task);
+
+    /// 创建频道的标签页并加载本地缓存的消息，已存在时直接返回
+    /// \param channel 频道名
+    ChannelTab& open_tab(const std::string& channel);
+
+    /// 当前选中的标签页对应的频道，没有标签页时为空
+    std::string selected_channel();
+
+    /// 更新标签页标题，有未读消息时显示未读数
+    /// \param channel 频道名
+    /// \param tab 频道的标签页
+    void update_tab_label(const std::string& channel, ChannelTab& tab);
+
+    /// 关闭所有标签页，重新连接时调用
+    void clear_tabs();
 };
 
 
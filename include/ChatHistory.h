@@ -0,0 +1,164 @@
+//
+// Created by 穆琰鑫 on 2024/10/22.
+//
+
+#ifndef HACK_CHAT_CHATHISTORY_H
+#define HACK_CHAT_CHATHISTORY_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "sqlite3.h"
+#include "HistoryRecord.h"
+
+/**
+ * @brief 频道聊天记录存储，基于 SQLite 和 FTS5 全文索引
+ *
+ * append 只在内存中分配序号并排队，由后台线程按批写入数据库和索引，
+ * 不阻塞网络 I/O 线程；增量获取在同一线程执行，搜索在独立的只读连接和线程上执行，
+ * 耗时较长的搜索不会推迟写入和历史回复，结果都通过回调返回。
+ */
+class ChatHistory {
+public:
+    using SearchCallback = std::function<void(std::vector<HistoryRecord> records, bool has_more)>;
+    using FetchCallback = std::function<void(std::vector<HistoryRecord> records, bool truncated)>;
+
+    /**
+     * @brief 构造函数，打开数据库并启动后台写入线程
+     * @param db_path 数据库文件路径
+     * @param batch_size 每个事务最多写入的消息数
+     * @param flush_interval 未满一批时的最长等待时间
+     * @throws std::runtime_error 数据库无法打开或建表失败时抛出
+     */
+    explicit ChatHistory(const std::string& db_path, std::size_t batch_size = 256,
+                         std::chrono::milliseconds flush_interval = std::chrono::milliseconds(50));
+
+    /**
+     * @brief 析构函数，写入剩余消息后关闭数据库
+     */
+    ~ChatHistory();
+
+    ChatHistory(const ChatHistory&) = delete;
+    ChatHistory& operator=(const ChatHistory&) = delete;
+
+    /**
+     * @brief 追加一条频道消息，立即返回分配的序号
+     * @param channel 频道名称
+     * @param sender 发送者用户名
+     * @param content 消息内容
+     * @return 该消息在频道内的序号
+     */
+    std::uint64_t append(std::string_view channel, std::string_view sender, std::string_view content);
+
+    /**
+     * @brief 在频道历史中全文搜索，结果按相关度排序并分页
+     *
+     * 频道和查询文本在全文索引中求交，只取本频道最近的一批匹配，在其中按 BM25 排序，
+     * 高频词的查询耗时因此有上界；少于三个字符的查询无法使用索引，
+     * 只扫描频道内最近的消息并按时间倒序返回。搜索能看到调用前追加的所有消息。
+     * @param channel 频道名称
+     * @param query 搜索文本，按短语匹配
+     * @param page 页码，从 0 开始
+     * @param page_size 每页条数
+     * @param callback 在后台线程中调用的结果回调
+     */
+    void search(const std::string& channel, const std::string& query, std::size_t page, std::size_t page_size,
+                SearchCallback callback);
+
+    /**
+     * @brief 获取频道中序号大于 after_seq 的最新消息，按序号升序返回
+     * @param channel 频道名称
+     * @param after_seq 调用方已有的最大序号，0 表示没有
+     * @param limit 最多返回条数
+     * @param callback 在后台线程中调用的结果回调，truncated 表示更早的部分消息未返回
+     */
+    void fetch_after(const std::string& channel, std::uint64_t after_seq, std::size_t limit, FetchCallback callback);
+
+    /**
+     * @brief 阻塞直到所有已追加的消息写入数据库
+     */
+    void flush();
+
+    /**
+     * @brief 历史纪元，数据库创建时随机生成并持久保存
+     *
+     * 换用新数据库后序号从 1 重新开始，纪元随之改变，客户端据此丢弃旧的本地缓存。
+     */
+    const std::string& epoch() const { return epoch_; }
+
+private:
+    /**
+     * @brief 后台线程主循环，批量写入消息并执行增量获取任务
+     */
+    void worker_loop();
+
+    /**
+     * @brief 搜索线程主循环，等待此前追加的消息写入后执行搜索任务
+     */
+    void search_loop();
+
+    /**
+     * @brief 在一个事务中写入一批消息及其索引
+     * @param batch 待写入的消息
+     */
+    void write_batch(const std::vector<HistoryRecord>& batch);
+
+    /**
+     * @brief 执行一条不返回结果的 SQL，失败时抛出异常
+     */
+    void exec(const char* sql);
+
+    /**
+     * @brief 创建或升级全文索引，旧版只索引正文的索引会按现有消息重建
+     */
+    void migrate_index();
+
+    /**
+     * @brief 读取历史纪元，数据库中没有时生成并保存
+     */
+    void load_epoch();
+
+    /**
+     * @brief 从数据库读取每个频道当前的最大序号
+     */
+    void load_sequences();
+
+    sqlite3* db_ = nullptr;                 ///< 数据库连接，只在后台线程和构造、析构中使用
+    sqlite3* search_db_ = nullptr;          ///< 搜索用的只读连接，只在搜索线程和构造、析构中使用
+    sqlite3_stmt* insert_message_ = nullptr; ///< 插入消息的预编译语句
+    sqlite3_stmt* insert_index_ = nullptr;   ///< 插入全文索引的预编译语句
+    sqlite3_stmt* search_ = nullptr;         ///< 全文索引搜索的预编译语句，属于 search_db_
+    sqlite3_stmt* scan_ = nullptr;           ///< 短查询在最近消息中子串扫描的预编译语句，属于 search_db_
+    sqlite3_stmt* fetch_ = nullptr;          ///< 按序号增量获取的预编译语句
+
+    std::size_t batch_size_;                     ///< 每批最多写入条数
+    std::chrono::milliseconds flush_interval_;   ///< 攒批的最长等待时间
+
+    std::mutex mutex_;                           ///< 保护下面的队列和状态
+    std::condition_variable wake_;               ///< 唤醒后台线程
+    std::condition_variable flushed_;            ///< 通知 flush 调用者和搜索线程
+    std::condition_variable search_wake_;        ///< 唤醒搜索线程
+    std::vector<HistoryRecord> pending_;         ///< 等待写入的消息
+    std::deque<std::function<void()>> tasks_;    ///< 等待执行的增量获取任务
+    /// 等待执行的搜索任务及提交时已追加的消息总数
+    std::deque<std::pair<std::uint64_t, std::function<void()>>> search_tasks_;
+    std::uint64_t appended_ = 0;                 ///< 已追加的消息总数
+    std::uint64_t written_ = 0;                  ///< 已写入数据库的消息总数
+    bool flush_requested_ = false;               ///< 是否有调用者在等待 flush 完成
+    bool stopping_ = false;                      ///< 是否正在关闭
+
+    std::string epoch_;                          ///< 历史纪元，构造后不再改变
+    std::unordered_map<std::string, std::uint64_t> last_seq_; ///< 每个频道已分配的最大序号，仅调用方线程使用
+    std::thread worker_;                         ///< 后台写入与增量获取线程
+    std::thread search_worker_;                  ///< 搜索线程
+};
+
+#endif //HACK_CHAT_CHATHISTORY_H
@@ -0,0 +1,86 @@
+//
+// Created by 穆琰鑫 on 2024/10/25.
+//
+
+#ifndef HACK_CHAT_HISTORYCACHE_H
+#define HACK_CHAT_HISTORYCACHE_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "sqlite3.h"
+#include "HistoryRecord.h"
+
+/**
+ * @brief 客户端本地聊天记录缓存，按服务器、历史纪元、频道和消息序号保存
+ *
+ * 打开频道时先从缓存渲染，再只向服务器请求缓存中最大序号之后的消息。
+ * 服务器换用新的历史数据库后序号重新开始，纪元随之改变，旧纪元的缓存被丢弃。
+ * GUI 线程读取、网络线程写入，内部用互斥锁串行化对数据库的访问。
+ */
+class HistoryCache {
+public:
+    /**
+     * @brief 构造函数，打开或创建缓存数据库
+     * @param db_path 缓存文件路径
+     * @throws std::runtime_error 数据库无法打开或建表失败时抛出
+     */
+    explicit HistoryCache(const std::string& db_path);
+
+    /**
+     * @brief 析构函数，关闭数据库
+     */
+    ~HistoryCache();
+
+    HistoryCache(const HistoryCache&) = delete;
+    HistoryCache& operator=(const HistoryCache&) = delete;
+
+    /**
+     * @brief 读取频道最近的缓存消息，按序号升序返回
+     * @param server 服务器标识，地址加端口
+     * @param epoch 服务器的历史纪元
+     * @param channel 频道名称
+     * @param limit 最多返回条数
+     */
+    std::vector<HistoryRecord> load_recent(const std::string& server, const std::string& epoch,
+                                           const std::string& channel, std::size_t limit);
+
+    /**
+     * @brief 缓存中频道的最大序号
+     * @return 没有缓存时返回 0
+     */
+    std::uint64_t last_seq(const std::string& server, const std::string& epoch, const std::string& channel);
+
+    /**
+     * @brief 在一个事务中写入一批消息，已存在的序号会被覆盖
+     * @param server 服务器标识，地址加端口
+     * @param epoch 服务器的历史纪元
+     * @param records 待写入的消息，channel 字段必须填写
+     */
+    void store(const std::string& server, const std::string& epoch, const std::vector<HistoryRecord>& records);
+
+    /**
+     * @brief 最近一次从服务器得知的历史纪元
+     * @param server 服务器标识，地址加端口
+     * @return 没有记录时返回空字符串
+     */
+    std::string epoch(const std::string& server);
+
+    /**
+     * @brief 记录服务器的历史纪元，并删除该服务器其他纪元的缓存消息
+     * @param server 服务器标识，地址加端口
+     * @param epoch 服务器的历史纪元
+     */
+    void set_epoch(const std::string& server, const std::string& epoch);
+
+private:
+    sqlite3* db_ = nullptr;             ///< 缓存数据库连接
+    sqlite3_stmt* insert_ = nullptr;    ///< 写入消息的预编译语句
+    sqlite3_stmt* recent_ = nullptr;    ///< 读取最近消息的预编译语句
+    sqlite3_stmt* last_seq_ = nullptr;  ///< 读取最大序号的预编译语句
+    sqlite3_stmt* epoch_ = nullptr;     ///< 读取历史纪元的预编译语句
+    std::mutex mutex_;                  ///< 串行化 GUI 线程和网络线程的访问
+};
+
+#endif //HACK_CHAT_HISTORYCACHE_H
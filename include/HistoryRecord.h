@@ -0,0 +1,23 @@
+//
+// Created by 穆琰鑫 on 2024/10/25.
+//
+
+#ifndef HACK_CHAT_HISTORYRECORD_H
+#define HACK_CHAT_HISTORYRECORD_H
+
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief 一条已保存的频道消息，服务器的聊天记录存储和客户端的本地缓存共用
+ */
+struct HistoryRecord {
+    std::uint64_t seq = 0;      ///< 频道内的消息序号，从 1 开始递增
+    std::string channel;        ///< 频道名称
+    std::string sender;         ///< 发送者用户名
+    std::string content;        ///< 消息内容
+    std::int64_t timestamp = 0; ///< 服务器接收时间，Unix 毫秒
+    double rank = 0;            ///< 搜索相关度（BM25 得分取负），越小越相关，仅搜索结果有效
+};
+
+#endif //HACK_CHAT_HISTORYRECORD_H
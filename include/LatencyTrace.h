@@ -0,0 +1,58 @@
+//
+// Created by 穆琰鑫 on 2024/10/24.
+//
+
+#ifndef HACK_CHAT_LATENCYTRACE_H
+#define HACK_CHAT_LATENCYTRACE_H
+
+#include <array>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+
+/**
+ * @brief 获取单调时钟的当前时间
+ * @return 纳秒数，只能与同一进程内的其他时间戳相减
+ */
+std::int64_t monotonic_now_ns();
+
+/**
+ * @brief 对数分桶的延迟直方图
+ *
+ * 第 i 个桶统计 [2^i, 2^(i+1)) 微秒的样本，记录是 O(1) 且不分配内存，
+ * 适合在消息路径上采样记录。
+ */
+class LatencyHistogram {
+public:
+    /**
+     * @brief 记录一个样本，负值按 0 处理
+     * @param nanoseconds 延迟，纳秒
+     */
+    void record(std::int64_t nanoseconds);
+
+    /**
+     * @brief 样本数量
+     */
+    std::uint64_t count() const { return count_; }
+
+    /**
+     * @brief 估算分位数，返回所在桶的上界
+     * @param quantile 分位，取值 0 到 1
+     * @return 延迟上界，微秒
+     */
+    std::uint64_t percentile_us(double quantile) const;
+
+    /**
+     * @brief 导出为 JSON，包含样本数、均值、p50/p90/p99/max 和非空的桶
+     */
+    nlohmann::json to_json() const;
+
+private:
+    static constexpr std::size_t kBuckets = 32; ///< 最大桶覆盖约 35 分钟
+
+    std::array<std::uint64_t, kBuckets> buckets_{}; ///< 各桶样本数
+    std::uint64_t count_ = 0;                       ///< 样本总数
+    std::int64_t sum_ns_ = 0;                       ///< 延迟总和，纳秒
+    std::int64_t max_ns_ = 0;                       ///< 最大延迟，纳秒
+};
+
+#endif //HACK_CHAT_LATENCYTRACE_H
@@ -13,8 +13,24 @@
 #include <string>
 #include <regex>
 #include <optional>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <string_view>
+#include <unordered_map>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
 #include <nlohmann/json.hpp>
 #include "FL/Fl_Text_Buffer.H"
+#include "UpgradeHandoff.h"
+#include "ChatHistory.h"
+#include "LatencyTrace.h"
+#include "HistoryCache.h"
+#include "TrafficCapture.h"
+#include "ChannelRouter.h"
 
 //使用boost的tcp命名空间
 using tcp=boost::asio::ip::tcp;
@@ -24,71 +40,169 @@ using error_code=boost::system::error_code;
 // 使用nlohmann的json命名空间
 using json = nlohmann::json;
 
+/**
+ * @brief 客户端请求
+ *
+ * 字符串成员使用多态分配器，服务器解析请求时从会话的分发缓冲区分配，一批请求处理完后整体释放；
+ * 拷贝得到的请求使用默认内存资源，可以安全地保存到异步回调中。
+ */
 struct RequestMessage {
-    std::string type;       // "connect", "get_channel_list", "join_channel", "send_message"
-    std::string username;   // 用户名，所有请求都携带用户名
-    std::string channel;    // 针对 "join_channel" 和 "send_message" 类型
-    std::string content;    // 针对 "send_message" 类型的消息内容
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    std::pmr::string type;       // "connect", "get_channel_list", "join_channel", "subscribe", "unsubscribe", "send_message", "search", "get_history"
+    std::pmr::string username;   // 用户名，所有请求都携带用户名
+    std::pmr::string channel;    // 针对 "join_channel"、"subscribe"、"unsubscribe"、"send_message"、"search" 和 "get_history" 类型
+    std::pmr::string content;    // 针对 "send_message" 类型的消息内容，"search" 类型的搜索文本
+    std::uint32_t page = 0; // 针对 "search" 类型的页码，从 0 开始
+    std::uint64_t after_seq = 0; // 针对 "get_history" 类型，只返回序号大于它的消息
+    json trace;             // 采样的延迟追踪时间戳，未采样时为 null 且不序列化
+
+    RequestMessage() = default;
+
+    explicit RequestMessage(const allocator_type& alloc)
+            : type(alloc), username(alloc), channel(alloc), content(alloc) {}
+
+    RequestMessage(std::string_view type, std::string_view username, std::string_view channel,
+                   std::string_view content, std::uint32_t page = 0, const allocator_type& alloc = {})
+            : type(type, alloc), username(username, alloc), channel(channel, alloc), content(content, alloc),
+              page(page) {}
 
     // 序列化：将 RequestMessage 转为 JSON 格式
     json to_json() const {
-        return {
+        json json_data = {
                 {"type", type},
                 {"username", username},
                 {"channel", channel},
                 {"content", content}
         };
+        if (page != 0)
+            json_data["page"] = page;
+        if (after_seq != 0)
+            json_data["after_seq"] = after_seq;
+        if (!trace.is_null())
+            json_data["trace"] = trace;
+        return json_data;
     }
 
-    // 反序列化：从 JSON 格式转换为 RequestMessage 结构
-    static RequestMessage from_json(const nlohmann::json& json_data) {
-        RequestMessage msg;
-        msg.type = json_data.at("type").get<std::string>();
-        msg.username = json_data.at("username").get<std::string>();
+    // 反序列化：从 JSON 格式转换为 RequestMessage 结构，字符串从 alloc 分配
+    static RequestMessage from_json(const nlohmann::json& json_data, const allocator_type& alloc = {}) {
+        RequestMessage msg(alloc);
+        msg.type = json_data.at("type").get_ref<const std::string&>();
+        msg.username = json_data.at("username").get_ref<const std::string&>();
         if (json_data.contains("channel"))
-            msg.channel = json_data.at("channel").get<std::string>();
+            msg.channel = json_data.at("channel").get_ref<const std::string&>();
         if (json_data.contains("content"))
-            msg.content = json_data.at("content").get<std::string>();
+            msg.content = json_data.at("content").get_ref<const std::string&>();
+        if (json_data.contains("page"))
+            msg.page = json_data.at("page").get<std::uint32_t>();
+        if (json_data.contains("after_seq"))
+            msg.after_seq = json_data.at("after_seq").get<std::uint64_t>();
+        if (json_data.contains("trace"))
+            msg.trace = json_data.at("trace");
         return msg;
     }
 };
 
+/**
+ * @brief 服务器回复，字符串成员同样可以使用调用方提供的内存资源
+ */
 struct ResponseMessage {
-    std::string type;       // "connect", "channel_list", "join_channel", "error"
-    std::string status;     // 成功或者失败的状态信息，比如 "success", "error"
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    std::pmr::string type;       // "connect", "channel_list", "join_channel", "subscribe", "unsubscribe", "search_result", "history", "chunk", "error"
+    std::pmr::string status;     // 成功或者失败的状态信息，比如 "success", "error"
     json content; // 响应内容，使用 JSON 存储，可以是数组、对象或字符串等
+    json trace;   // 回传请求的延迟追踪时间戳并附加服务器时间戳，未采样时为 null 且不序列化
+
+    ResponseMessage() = default;
+
+    explicit ResponseMessage(const allocator_type& alloc) : type(alloc), status(alloc) {}
+
+    ResponseMessage(std::string_view type, std::string_view status, json content = nullptr,
+                    const allocator_type& alloc = {})
+            : type(type, alloc), status(status, alloc), content(std::move(content)) {}
 
     // 序列化：将 ResponseMessage 转为 JSON 格式
     json to_json() const {
-        return {
+        json json_data = {
                 {"type", type},
                 {"status", status},
                 {"content", content}
         };
+        if (!trace.is_null())
+            json_data["trace"] = trace;
+        return json_data;
     }
 
-    // 反序列化：从 JSON 格式转换为 ResponseMessage 结构
-    static ResponseMessage from_json(const json& json_data) {
-        ResponseMessage response;
-        response.type = json_data.at("type").get<std::string>();
-        response.status = json_data.at("status").get<std::string>();
+    // 反序列化：从 JSON 格式转换为 ResponseMessage 结构，字符串从 alloc 分配
+    static ResponseMessage from_json(const json& json_data, const allocator_type& alloc = {}) {
+        ResponseMessage response(alloc);
+        response.type = json_data.at("type").get_ref<const std::string&>();
+        response.status = json_data.at("status").get_ref<const std::string&>();
         if (json_data.contains("content"))
             response.content = json_data.at("content");
+        if (json_data.contains("trace"))
+            response.trace = json_data.at("trace");
         return response;
     }
 };
 
+/// 超过该字节数的帧拆成分块发送
+inline constexpr std::size_t kChunkThreshold = 16 * 1024;
+/// 每个分块携带的帧字节数
+inline constexpr std::size_t kChunkSize = 4 * 1024;
 
 std::optional<std::string> validate_ip_or_hostname(const std::string& input);
 bool validate_port(const std::string& port);
+std::string encode_frame(const RequestMessage& request);
+std::string encode_frame(const ResponseMessage& response);
+std::string encode_chunk(std::uint32_t id, std::uint32_t index, std::string_view content, std::size_t& offset);
+
+/**
+ * @brief 客户端连接参数
+ */
+struct ConnectOptions {
+    std::chrono::milliseconds resolve_timeout{5000};      ///< 域名解析超时
+    std::chrono::milliseconds connect_timeout{10000};     ///< 解析完成后所有地址尝试的总超时
+    std::chrono::milliseconds attempt_delay{250};         ///< Happy Eyeballs 相邻地址尝试的错开时间
+    bool auto_reconnect = true;                           ///< 连接断开后是否自动重连
+    std::chrono::milliseconds reconnect_initial{500};     ///< 首次重连等待时间
+    std::chrono::milliseconds reconnect_max{30000};       ///< 重连等待时间上限
+};
+
+/**
+ * @brief 客户端连接状态变化
+ */
+enum class ConnectionEvent {
+    connected,     ///< 首次连接成功
+    failed,        ///< 首次连接失败，不会自动重试
+    disconnected,  ///< 已建立的连接断开，开启自动重连时随后会重试
+    reconnected    ///< 断开后重连成功，并已重新订阅之前的频道
+};
+
+/**
+ * @brief 客户端已订阅频道的显示状态
+ */
+struct ChannelSubscription {
+    std::uint64_t displayed_seq = 0;  ///< 已显示的最大消息序号
+    bool history_pending = false;     ///< 是否在等待订阅后的历史回复
+    std::uint64_t requested_seq = 0;  ///< 等待中的历史请求的 after_seq，用于识别过期的回复
+    std::chrono::steady_clock::time_point requested_at; ///< 最近一次发出历史请求的时间，超时未收到回复时重发
+    std::vector<json> held_messages;  ///< 等待历史回复期间收到的实时消息
+};
+
+struct ConnectRace;
 
 /**
  * @brief 客户端网络类，负责与服务器通信
  */
 class ClientNetwork {
 public:
-    using MessageCallback = std::function<void(const std::string&)>;
+    using MessageCallback = std::function<void(const std::string& channel, const std::string& message)>;
     using ChannelListCallback = std::function<void(const std::vector<std::string>&)>;
+    using SearchResultCallback = std::function<void(const json&)>;
+    using ConnectionCallback = std::function<void(ConnectionEvent, const std::string&)>;
+    using RenderCallback = std::function<void(std::int64_t received_ns)>;
     /**
      * @brief 构造函数
      * @param server 服务器地址
@@ -108,9 +222,18 @@ public:
     void start_io_context();
 
     /**
-     * @brief 连接到服务器
+     * @brief 设置连接超时、地址尝试错开时间和重连退避参数，需在连接前调用
+     * @param options 连接参数
+     */
+    void set_connect_options(const ConnectOptions& options);
+
+    /**
+     * @brief 异步连接到服务器，结果通过连接状态回调通知
+     *
+     * 解析得到的地址按协议族交替排列，依次错开启动连接尝试，第一个成功的连接胜出，
+     * 其余尝试立即取消。解析和连接分别受超时限制。需要 io_context_ 在其他线程运行。
      */
-    bool connect_to_server();
+    void async_connect();
 
     /**
      * @brief 获取服务器上的频道列表
@@ -118,11 +241,37 @@ public:
     void get_channel_list();
 
     /**
-     * @brief 加入指定频道
+     * @brief 加入指定频道：尚未订阅时先订阅，然后设为当前频道，不影响其他订阅
      * @param channel 频道名称
      */
     void join_channel(const std::string& channel);
 
+    /**
+     * @brief 订阅频道，并只请求本地缓存或已显示消息之后的历史
+     *
+     * 同一连接可以订阅多个频道，各频道的消息通过消息回调的频道参数区分。
+     * @param channel 频道名称
+     */
+    void subscribe_channel(const std::string& channel);
+
+    /**
+     * @brief 退订频道，之后不再接收该频道的消息
+     * @param channel 频道名称
+     */
+    void unsubscribe_channel(const std::string& channel);
+
+    /**
+     * @brief 设置当前频道，发送消息和搜索都针对当前频道
+     * @param channel 频道名称
+     */
+    void set_active_channel(const std::string& channel);
+
+    /**
+     * @brief 是否已订阅频道
+     * @param channel 频道名称
+     */
+    bool is_subscribed(const std::string& channel);
+
     /**
      * @brief 向指定频道发送消息
      * @param channel 频道名称
@@ -130,6 +279,29 @@ public:
      */
     void send_message(const std::string& message);
 
+    /**
+     * @brief 在当前频道的历史消息中搜索
+     * @param query 搜索文本
+     * @param page 页码，从 0 开始
+     */
+    void search(const std::string& query, std::uint32_t page = 0);
+
+    /**
+     * @brief 开启本地聊天记录缓存
+     *
+     * 开启后打开频道时可先显示缓存的消息，加入频道时只向服务器请求缓存之后的新消息。
+     * @param db_path 缓存文件路径
+     * @return 缓存无法打开时返回 false，客户端照常工作但不缓存
+     */
+    bool enable_history_cache(const std::string& db_path);
+
+    /**
+     * @brief 读取频道最近的缓存消息，用于打开频道时立即显示
+     * @param channel 频道名称
+     * @return 已格式化的消息行，按时间顺序；未开启缓存时为空
+     */
+    std::vector<std::string> cached_messages(const std::string& channel);
+
     /**
      * @brief 开始持续接收服务器发送的消息。
      */
@@ -141,6 +313,42 @@ public:
      */
     void handle_server_message(const ResponseMessage& message);
 
+    /**
+     * @brief 拼接服务器分块发送的大消息，收到最后一块后按普通消息处理
+     * @param chunk 分块内容，包含 id、index、last 和 data
+     */
+    void handle_chunk(const json& chunk);
+
+    /**
+     * @brief 处理服务器返回的增量历史，写入缓存并显示，然后显示等待期间收到的实时消息
+     *
+     * 回复中的纪元与缓存的不同时，说明服务器的历史已经重建，丢弃旧缓存并从头重新请求所有频道。
+     * @param response 历史回复，content 包含 channel、after_seq、epoch、truncated 和 messages
+     */
+    void handle_history(const ResponseMessage& response);
+
+    /**
+     * @brief 设置延迟追踪的采样率
+     *
+     * 采样的请求携带客户端单调时钟的发送时间，服务器在回复中附加接收、分发和发送时间，
+     * 客户端据此统计往返、服务器停留、网络与渲染耗时。采样率为 0 时不产生任何开销，
+     * 大于 0 时每分钟打印一次直方图。
+     * @param rate 采样率，取值 0 到 1
+     */
+    void set_trace_sample_rate(double rate);
+
+    /**
+     * @brief 导出延迟追踪直方图
+     * @return 各阶段直方图的 JSON，键为阶段名
+     */
+    json trace_report();
+
+    /**
+     * @brief 记录采样回复从读取完成到界面显示完成的耗时
+     * @param received_ns 回复读取完成的单调时间，由渲染回调传入
+     */
+    void record_render(std::int64_t received_ns);
+
     /**
      * @brief 设置信息转发展示回调
      * @param callback 上层gui给定的回调函数
@@ -151,17 +359,217 @@ public:
      * @param callback 上层gui给定的频道设置回调
      */
     void setChannelListCallback(ChannelListCallback callback);
+    /**
+     * @brief 设置搜索结果回调
+     * @param callback 上层gui给定的搜索结果回调，参数为结果页的 JSON 内容
+     */
+    void setSearchResultCallback(SearchResultCallback callback);
+    /**
+     * @brief 设置采样回复的渲染回调
+     *
+     * 本客户端采样的回复在其他回调执行完后调用，界面在显示完成后调用 record_render；
+     * 未设置时在回调返回时直接统计渲染耗时。
+     * @param callback 上层gui给定的回调，参数为回复读取完成的单调时间，在 I/O 线程中调用
+     */
+    void setRenderCallback(RenderCallback callback);
+    /**
+     * @brief 设置连接状态回调
+     * @param callback 上层gui给定的连接状态回调，在 I/O 线程中调用
+     */
+    void setConnectionCallback(ConnectionCallback callback);
 
     std::string username_;                ///< 用户名
-    std::string channel_;                 ///<选择的频道名
+    std::string channel_;                 ///<当前频道名，发送消息和搜索使用
     boost::asio::io_context io_context_;  ///< Boost Asio的IO上下文
 private:
     boost::asio::ip::tcp::socket socket_; ///< TCP socket
+    std::deque<std::shared_ptr<const std::string>> write_queue_; ///< 等待发送的帧，只在 I/O 线程中使用
+    bool writing_ = false;                ///< 是否有异步写正在进行
+    std::uint64_t socket_generation_ = 0; ///< socket 每次被替换或关闭时加一，忽略旧连接上的写完成
     std::string server_;                  ///< 服务器地址
     std::string port_;                    ///< 服务器端口
+    std::string read_buffer_;             ///< 读缓冲，保存已读取但尚未解析的字节
+    std::unordered_map<std::uint32_t, std::string> pending_chunks_; ///< 正在拼接的分块消息
+    std::int64_t received_ns_ = 0;        ///< 最近一帧读取完成的单调时间
+
+    double trace_sample_rate_ = 0;        ///< 延迟追踪采样率
+    std::mt19937 trace_rng_{std::random_device{}()}; ///< 采样用的随机数发生器
+    std::uint64_t next_trace_id_ = 1;     ///< 下一个追踪编号
+    std::mutex trace_mutex_;              ///< 保护 trace_histograms_ 和 pending_traces_，渲染统计在 GUI 线程
+    std::map<std::string, LatencyHistogram> trace_histograms_; ///< 各阶段的延迟直方图
+    std::map<std::uint64_t, std::int64_t> pending_traces_; ///< 已发出但尚未收到回复的追踪编号及其发送时间
+    boost::asio::steady_timer trace_report_timer_; ///< 定期打印延迟直方图的定时器
+
+    std::unique_ptr<HistoryCache> history_cache_; ///< 本地聊天记录缓存，未开启时为空
+    std::mutex history_mutex_;            ///< 保护订阅状态和当前频道，订阅在 GUI 线程
+    std::map<std::string, ChannelSubscription> subscriptions_; ///< 已订阅频道的显示状态
+    std::string server_epoch_;            ///< 服务器的历史纪元，与地址一起作为缓存的键
+
+    ConnectOptions connect_options_;      ///< 连接参数
+    boost::asio::steady_timer reconnect_timer_; ///< 重连退避定时器
+    boost::asio::steady_timer history_retry_timer_; ///< 重发超时历史请求的定时器
+    bool history_retry_scheduled_ = false; ///< 重发定时器是否已经启动，只在 I/O 线程中使用
+    std::chrono::milliseconds reconnect_delay_{0}; ///< 下一次重连的退避上限
+    std::mt19937 reconnect_rng_{std::random_device{}()}; ///< 重连抖动用的随机数发生器
+    bool connected_ = false;              ///< 是否曾经连接成功，决定断开后是否重连
 
     MessageCallback message_callback_;
     ChannelListCallback channel_list_callback_;
+    SearchResultCallback search_result_callback_;
+    ConnectionCallback connection_callback_;
+    RenderCallback render_callback_;
+
+    /**
+     * @brief 按采样率为请求附加追踪时间戳，然后交给 I/O 线程排队发送，可在任意线程调用
+     * @param request 待发送的请求
+     */
+    void write_request(RequestMessage& request);
+
+    /**
+     * @brief 从写队列中取出下一帧异步发送，只在 I/O 线程中调用
+     */
+    void pump_writes();
+
+    /**
+     * @brief 记录一条本客户端发起的追踪回复的网络和服务器耗时
+     * @param trace 回复中携带的追踪时间戳
+     * @return 是本客户端尚未收到回复的采样请求时返回 true
+     */
+    bool record_trace(const json& trace);
+
+    /**
+     * @brief 定期打印客户端的延迟追踪直方图，没有采样时不输出
+     */
+    void schedule_trace_report();
+
+    /**
+     * @brief 启动历史请求的重发定时器，只在 I/O 线程中调用
+     *
+     * 回复可能在连接断开或服务器升级时丢失，等待超过重发间隔的频道按原 after_seq 重新请求，
+     * 直到所有频道都收到回复。
+     */
+    void schedule_history_retry();
+
+    /**
+     * @brief 显示一条实时消息，跳过已显示的序号，并写入缓存
+     * @param content 消息内容，包含 sender、channel、content 和可选的 seq
+     * @return 是否显示了消息
+     */
+    bool show_live_message(const json& content);
+
+    /**
+     * @brief 解析服务器地址并按 Happy Eyeballs 方式竞争连接
+     * @param done 完成回调，成功时携带胜出的socket，超时错误为 timed_out
+     */
+    void start_connect(std::function<void(const error_code&, std::shared_ptr<tcp::socket>)> done);
+
+    /**
+     * @brief 启动下一个地址的连接尝试，并在错开时间后继续启动后面的地址
+     * @param race 本次连接的竞争状态
+     */
+    void try_next_endpoint(const std::shared_ptr<ConnectRace>& race);
+
+    /**
+     * @brief 结束连接竞争，关闭未胜出的尝试并调用完成回调
+     * @param race 本次连接的竞争状态
+     * @param ec 结果错误码
+     * @param winner 胜出的socket，失败时为空
+     */
+    void finish_connect(const std::shared_ptr<ConnectRace>& race, const error_code& ec,
+                        std::shared_ptr<tcp::socket> winner = nullptr);
+
+    /**
+     * @brief 采用胜出的socket，发送用户名并清理上一个连接遗留的读状态
+     * @param socket 胜出的socket
+     */
+    void adopt_socket(std::shared_ptr<tcp::socket> socket);
+
+    /**
+     * @brief 已建立的连接断开，通知上层并按退避时间安排重连
+     * @param ec 断开原因
+     */
+    void handle_disconnect(const error_code& ec);
+
+    /**
+     * @brief 按指数退避加随机抖动等待后重连，成功后重新加入之前的频道
+     */
+    void schedule_reconnect();
+
+    /**
+     * @brief 缓存中使用的服务器标识
+     */
+    std::string cache_key() const { return server_ + ":" + port_; }
+};
+
+/**
+ * @brief 正在分块发送的大消息
+ */
+struct BulkTransfer {
+    /// 已编码的全部分块帧，广播时由所有接收者共享
+    std::shared_ptr<const std::vector<std::string>> chunks;
+    std::size_t next = 0;                     ///< 下一个要发送的分块序号
+    std::int64_t traced_since_ns = 0;         ///< 采样帧的入队时间，未采样为 0
+};
+
+/**
+ * @brief 写队列中的一帧
+ */
+struct OutboundFrame {
+    std::shared_ptr<const std::string> data; ///< 已序列化的帧，以换行结尾
+    std::int64_t traced_since_ns = 0;        ///< 采样帧的入队时间，用于统计写完成耗时，未采样为 0
+};
+
+/**
+ * @brief 服务器端的客户端会话，保存socket、读缓冲和分优先级的写队列
+ *
+ * 控制回复和短消息进入优先队列，超过阈值的大消息拆成分块放入大块队列，
+ * 每写完一个分块都会先发送优先队列中的帧，避免大消息阻塞交互流量。
+ * 读缓冲、写队列节点和分发缓冲区都从会话自己的内存池分配，只在 I/O 线程中使用，无需加锁，
+ * 短生命周期的分配在会话内循环复用，不经过全局堆。
+ */
+struct ClientSession {
+    std::uint32_t id = 0;                 ///< 会话编号，进程内唯一，平滑升级后保持不变
+    std::shared_ptr<tcp::socket> socket;  ///< 客户端的TCP socket
+    /// 会话内存池，必须先于使用它的成员构造
+    std::pmr::unsynchronized_pool_resource pool{std::pmr::pool_options{0, kPoolLargestBlock}};
+    std::pmr::string read_buffer{&pool};  ///< 读缓冲，保存已读取但尚未解析的字节
+    /// 一批请求的分发缓冲区，解析出的请求从这里分配，整批处理完后释放回会话内存池
+    std::pmr::monotonic_buffer_resource dispatch_arena{kDispatchArenaSize, &pool};
+
+    std::pmr::deque<OutboundFrame> priority_queue{&pool}; ///< 控制回复和短消息
+    std::pmr::deque<BulkTransfer> bulk_queue{&pool};  ///< 正在分块发送的大消息，轮流发送
+    bool writing = false;                 ///< 是否有异步写正在进行
+    bool reading = false;                 ///< 是否有异步读正在进行，移交中止后据此恢复读取
+
+    /// 内存池直接复用的最大块，更大的分配（如超大粘贴）直接走全局堆
+    static constexpr std::size_t kPoolLargestBlock = 64 * 1024;
+    /// 分发缓冲区每次向内存池申请的初始大小，能容纳一批普通聊天请求
+    static constexpr std::size_t kDispatchArenaSize = 4 * 1024;
+
+    /**
+     * @brief 写队列为空且没有正在进行的写
+     */
+    bool write_idle() const {
+        return !writing && priority_queue.empty() && bulk_queue.empty();
+    }
+};
+
+/**
+ * @brief 频道广播的微批缓冲
+ *
+ * 开启批量窗口的频道把广播帧先攒在这里，窗口到期时拼接成一块，
+ * 频道中每个成员只需一次写即可收到窗口内的所有消息。
+ * 接收者在第一帧入队时确定，成员变化前会先发出已攒的帧，因此窗口内成员不变。
+ */
+struct ChannelBatch {
+    explicit ChannelBatch(boost::asio::io_context& io_context) : timer(io_context) {}
+
+    std::chrono::microseconds window{0};  ///< 批量窗口，0 表示不攒批
+    std::vector<OutboundFrame> frames;    ///< 窗口内待发送的广播帧
+    std::vector<std::shared_ptr<ClientSession>> recipients; ///< 第一帧入队时的频道成员
+    std::size_t bytes = 0;                ///< 待发送帧的总字节数
+    boost::asio::steady_timer timer;      ///< 窗口到期定时器
+    bool scheduled = false;               ///< 定时器是否已经启动
 };
 
 /**
@@ -176,12 +584,72 @@ public:
      */
     ServerNetwork(short port, const std::vector<std::string>& channels);
 
+    /**
+     * @brief 构造函数，从正在运行的旧进程接管监听socket、客户端socket和频道状态
+     *
+     * 旧进程的抓包文件和广播批量窗口一并继承，抓包追加到同一文件中。
+     * @param upgrade_path 旧进程的升级控制 Unix 域套接字路径
+     * @throws std::runtime_error 接管失败时抛出
+     */
+    explicit ServerNetwork(const std::string& upgrade_path);
+
     /**
      * @brief 运行服务器，接受客户端连接
      */
     void run_server();
 
+    /**
+     * @brief 停止事件循环，run_server 随后返回，可在任意线程调用
+     */
+    void stop() { io_context_.stop(); }
+
+    /**
+     * @brief 开启平滑升级模式，在指定路径监听新进程的接管请求
+     *
+     * 新进程连接后，本进程停止读取，等待已发出的写完成，
+     * 把所有socket和会话状态交给新进程，然后退出事件循环。
+     * 5 秒内写不完时放弃本次升级并继续服务，新进程接管失败后退出。
+     * @param upgrade_path 升级控制 Unix 域套接字路径
+     * @return 平台不支持或监听失败时返回 false
+     */
+    bool enable_upgrade(const std::string& upgrade_path);
+
+    /**
+     * @brief 开启聊天记录存储和全文搜索
+     *
+     * 已打开同一路径的数据库时不做任何事，接管时从旧进程继承的数据库不会被重复打开。
+     * @param db_path SQLite 数据库文件路径
+     * @throws std::runtime_error 数据库无法打开时抛出
+     */
+    void enable_history(const std::string& db_path);
+
+    /**
+     * @brief 开启入站流量抓包，记录每一帧的时间、会话编号和原始内容，供 traffic_replay 回放
+     *
+     * 已从旧进程继承同一路径的抓包时不做任何事，避免覆盖旧进程已写入的记录。
+     * @param path 抓包文件路径，已存在时覆盖
+     * @throws std::runtime_error 文件无法创建时抛出
+     */
+    void enable_capture(const std::string& path);
+
+    /**
+     * @brief 设置频道的广播批量窗口
+     *
+     * 窗口内同一频道的广播攒在一起，到期后每个成员一次写发送，
+     * 以不超过窗口的额外延迟换取更少的写调用和数据包，适合消息密集的频道。
+     * @param channel 频道名称，"*" 表示所有频道
+     * @param window 批量窗口，0 表示关闭，建议 1 到 5 毫秒
+     * @return 频道不存在时返回 false
+     */
+    bool set_broadcast_window(const std::string& channel, std::chrono::microseconds window);
+
 private:
+    /**
+     * @brief 打开监听socket，优先监听 IPv6 双栈地址，系统不支持时退回 IPv4
+     * @param port 服务器端口
+     */
+    void listen_dual_stack(unsigned short port);
+
     /**
      * @brief 接受客户端连接
      */
@@ -189,23 +657,190 @@ private:
 
     /**
      * @brief 处理客户端连接，读取并解析客户端的请求
-     * @param socket 客户端的TCP socket
+     * @param session 客户端会话
+     */
+    void handle_client(std::shared_ptr<ClientSession> session);
+
+    /**
+     * @brief 根据请求类型分发处理
+     * @param session 发出请求的客户端会话
+     * @param message 解析后的请求
+     */
+    void dispatch_request(const std::shared_ptr<ClientSession>& session, const RequestMessage& message);
+
+    /**
+     * @brief 把一帧数据放入客户端会话的写队列
+     *
+     * 不超过分块阈值的帧进入优先队列，较大的帧拆成分块放入大块队列。
+     * @param session 目标会话
+     * @param frame 已序列化的帧，以换行结尾，由所有接收者共享
+     * @param traced_since_ns 采样帧的入队时间，未采样为 0
+     */
+    void write_to_session(const std::shared_ptr<ClientSession>& session, std::shared_ptr<const std::string> frame,
+                          std::int64_t traced_since_ns = 0);
+
+    /**
+     * @brief 把大帧编码为分块帧，分配服务器内唯一的传输编号
+     * @param frame 已序列化的帧，以换行结尾，结尾换行不属于分块内容
+     * @return 全部分块帧，可由多个接收者共享
+     */
+    std::shared_ptr<const std::vector<std::string>> encode_chunks(const std::string& frame);
+
+    /**
+     * @brief 把已编码的分块放入客户端会话的大块队列
+     * @param session 目标会话
+     * @param chunks 全部分块帧，由所有接收者共享
+     * @param traced_since_ns 采样帧的入队时间，未采样为 0
+     */
+    void write_chunks_to_session(const std::shared_ptr<ClientSession>& session,
+                                 std::shared_ptr<const std::vector<std::string>> chunks,
+                                 std::int64_t traced_since_ns = 0);
+
+    /**
+     * @brief 从写队列中取出下一帧发送，优先队列先于大块分块
+     * @param session 目标会话
+     */
+    void pump_writes(const std::shared_ptr<ClientSession>& session);
+
+    /**
+     * @brief 取出大块队列队首传输的下一个分块，并把该传输轮换到队尾
+     * @param session 目标会话
+     * @return 分块帧，只有最后一块带有追踪入队时间
+     */
+    OutboundFrame next_chunk(ClientSession& session);
+
+    /**
+     * @brief 序列化回复；请求被采样时回传追踪时间戳并附加服务器发送时间
+     * @param response 待发送的回复
+     * @param request 对应的请求
+     * @return 已序列化的帧，以换行结尾
+     */
+    std::shared_ptr<const std::string> encode_response(ResponseMessage& response, const RequestMessage& request);
+
+    /**
+     * @brief 回复给请求者，请求被采样时统计写完成耗时
+     * @param session 目标会话
+     * @param response 待发送的回复
+     * @param request 对应的请求
      */
-    void handle_client(std::shared_ptr<tcp::socket> socket_ptr);
+    void reply(const std::shared_ptr<ClientSession>& session, ResponseMessage response, const RequestMessage& request);
+
+    /**
+     * @brief 定期打印服务器端的延迟追踪直方图
+     */
+    void schedule_trace_report();
+
+    /**
+     * @brief 定期把抓包缓冲写入文件，进程被终止时最多丢失一个周期的记录
+     */
+    void schedule_capture_flush();
+
+    /**
+     * @brief 频道是否在服务器的频道列表中
+     * @param channel 频道名称
+     */
+    bool has_channel(const std::string& channel) const;
+
+    /**
+     * @brief 移除断开的客户端会话
+     * @param session 断开的会话
+     */
+    void close_session(const std::shared_ptr<ClientSession>& session);
 
     /**
      * @brief 向频道中的所有客户端发送消息
+     * @param request 发送消息请求，包含频道、内容、发送者和追踪时间戳
+     */
+    void send_message_to_channel(const RequestMessage& request);
+
+    /**
+     * @brief 把一帧广播放入频道的批量缓冲，必要时启动窗口定时器
      * @param channel 频道名称
-     * @param message 消息内容
-     * @param sender 消息发送者的用户名
+     * @param batch 频道的批量缓冲
+     * @param frame 已序列化的广播帧
+     * @param traced_since_ns 采样帧的入队时间，未采样为 0
+     */
+    void batch_broadcast(const std::string& channel, ChannelBatch& batch, std::shared_ptr<const std::string> frame,
+                         std::int64_t traced_since_ns);
+
+    /**
+     * @brief 把频道批量缓冲中的帧拼接成一块，发给入队时的频道成员
+     * @param channel 频道名称
+     */
+    void flush_broadcast(const std::string& channel);
+
+#ifdef HACK_CHAT_HAS_UPGRADE_HANDOFF
+    /**
+     * @brief 等待升级控制连接
+     */
+    void accept_upgrade();
+
+    /**
+     * @brief 放弃移交，恢复接受连接和读取请求
+     * @param sessions 需要恢复读取的会话
+     */
+    void resume_after_handoff(const std::vector<std::shared_ptr<ClientSession>>& sessions);
+
+    /**
+     * @brief 开始向新进程移交：停止接受连接和读取请求，等待写完成后发送状态
+     * @param peer 与新进程的 Unix 域连接
+     */
+    void begin_handoff(std::shared_ptr<boost::asio::local::stream_protocol::socket> peer);
+
+    /**
+     * @brief 等待历史查询的回复和所有会话的异步写完成，再取消挂起的读后移交，超时则放弃本次升级
+     * @param peer 与新进程的 Unix 域连接
+     * @param deadline 最长等待时间点
+     * @param reads_cancelled 挂起的读是否已经取消
+     */
+    void drain_and_handoff(std::shared_ptr<boost::asio::local::stream_protocol::socket> peer,
+                           std::chrono::steady_clock::time_point deadline, bool reads_cancelled);
+#endif
+
+    /**
+     * @brief 在频道历史中搜索，结果在后台线程查询完成后回到 I/O 线程发送
+     * @param session 发出请求的客户端会话
+     * @param message 搜索请求，content 为搜索文本，page 为页码
+     */
+    void search_channel(const std::shared_ptr<ClientSession>& session, const RequestMessage& message);
+
+    /**
+     * @brief 返回频道中序号大于 after_seq 的消息，供客户端补齐本地缓存
+     * @param session 发出请求的客户端会话
+     * @param message 获取历史请求，after_seq 为客户端缓存中的最大序号
+     */
+    void fetch_channel_history(const std::shared_ptr<ClientSession>& session, const RequestMessage& message);
+
+    /**
+     * @brief 序列化频道与会话状态，用于移交给新进程
+     * @param sessions 移交的会话，顺序与描述符顺序一致
      */
-    void send_message_to_channel(const std::string& channel, const std::string& message, const std::string& sender);
+    json snapshot_state(const std::vector<std::shared_ptr<ClientSession>>& sessions) const;
 
     boost::asio::io_context io_context_;  ///< Boost Asio的IO上下文
     boost::asio::ip::tcp::acceptor acceptor_; ///< 接受客户端连接的对象
     std::vector<std::string> channels_; ///< 存储channels变量
-    std::unordered_map<std::string, std::vector<std::string>> channel_members_; ///< 频道和成员名的映射
-    boost::bimap<std::string, std::shared_ptr<tcp::socket>> client_usernames_;;  ///< 用户名和socket的双向映射
+    ChannelRouter router_; ///< 频道到订阅者的路由表，一个用户可以订阅多个频道
+    std::unordered_map<std::string, ChannelBatch> channel_batches_; ///< 开启批量窗口的频道的广播缓冲
+    boost::bimap<std::string, std::shared_ptr<ClientSession>> client_usernames_;  ///< 用户名和会话的双向映射
+    std::unordered_map<std::uint32_t, std::shared_ptr<ClientSession>> sessions_; ///< 所有已连接的会话
+    std::uint32_t next_session_id_ = 1; ///< 下一个会话编号
+    std::uint32_t next_transfer_id_ = 1; ///< 下一个分块传输编号，服务器内唯一
+    std::unique_ptr<ChatHistory> history_; ///< 聊天记录存储，未开启时为空
+    std::unique_ptr<TrafficCapture> capture_; ///< 入站流量抓包，未开启时为空
+    std::string capture_path_; ///< 抓包文件路径，移交时告知新进程继续追加
+    std::string history_path_; ///< 聊天记录数据库路径，移交时告知新进程继续使用
+    boost::asio::steady_timer capture_flush_timer_; ///< 定期刷盘抓包文件的定时器
+
+#ifdef HACK_CHAT_HAS_UPGRADE_HANDOFF
+    std::unique_ptr<boost::asio::local::stream_protocol::acceptor> upgrade_acceptor_; ///< 升级控制监听
+#endif
+    boost::asio::steady_timer drain_timer_; ///< 移交前等待写完成的定时器
+    bool upgrading_ = false; ///< 是否正在向新进程移交
+    std::size_t pending_history_replies_ = 0; ///< 已提交给历史后台线程、回复尚未进入写队列的请求数
+
+    std::map<std::string, LatencyHistogram> trace_histograms_; ///< 服务器端各阶段的延迟直方图
+    boost::asio::steady_timer trace_report_timer_; ///< 定期打印延迟直方图的定时器
 };
 
 #endif //HACK_CHAT_NETWORK_H
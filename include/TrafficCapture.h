@@ -0,0 +1,139 @@
+//
+// Created by 穆琰鑫 on 2024/10/26.
+//
+
+#ifndef HACK_CHAT_TRAFFICCAPTURE_H
+#define HACK_CHAT_TRAFFICCAPTURE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+/**
+ * @brief 抓包文件中的一条记录
+ */
+struct CaptureRecord {
+    enum Kind : std::uint8_t {
+        frame = 0, ///< 客户端发来的一帧，data 为原始字节，含结尾换行
+        close = 1, ///< 会话断开，data 为空
+        open = 2   ///< 会话建立，data 为空
+    };
+
+    std::int64_t offset_ns = 0;  ///< 距抓包开始的单调时间
+    std::uint32_t session_id = 0;///< 会话编号
+    Kind kind = frame;           ///< 记录类型
+    std::string data;            ///< 帧内容
+};
+
+/**
+ * @brief 服务器入站流量的追加写抓包文件
+ *
+ * 文件头为 8 字节魔数和抓包开始的 Unix 毫秒时间，之后每条记录为
+ * 8 字节时间偏移、4 字节会话编号、1 字节类型、4 字节长度和帧内容，整数均为小端。
+ * 写入经过 stdio 缓冲，在 I/O 线程中调用只是内存拷贝，由调用方定期调用 flush 刷盘。
+ */
+class TrafficCapture {
+public:
+    /**
+     * @brief 构造函数，创建抓包文件并写入文件头
+     * @param path 抓包文件路径，已存在时覆盖
+     * @throws std::runtime_error 文件无法创建时抛出
+     */
+    explicit TrafficCapture(const std::string& path);
+
+    /**
+     * @brief 构造函数，追加写入旧进程创建的抓包文件，用于平滑升级后继续抓包
+     *
+     * 单调时钟在整个系统内共享，沿用旧进程的开始时间，时间偏移在文件内保持连续。
+     * @param path 抓包文件路径
+     * @param start_ns 旧进程抓包开始的单调时间
+     * @throws std::runtime_error 文件无法打开时抛出
+     */
+    TrafficCapture(const std::string& path, std::int64_t start_ns);
+
+    /**
+     * @brief 析构函数，刷盘并关闭文件
+     */
+    ~TrafficCapture();
+
+    TrafficCapture(const TrafficCapture&) = delete;
+    TrafficCapture& operator=(const TrafficCapture&) = delete;
+
+    /**
+     * @brief 记录一帧入站数据
+     * @param session_id 会话编号
+     * @param frame 原始帧，含结尾换行
+     */
+    void record_frame(std::uint32_t session_id, std::string_view frame);
+
+    /**
+     * @brief 记录会话建立
+     * @param session_id 会话编号
+     */
+    void record_open(std::uint32_t session_id);
+
+    /**
+     * @brief 记录会话断开
+     * @param session_id 会话编号
+     */
+    void record_close(std::uint32_t session_id);
+
+    /**
+     * @brief 把缓冲中的记录写入文件
+     */
+    void flush();
+
+    /**
+     * @brief 抓包开始的单调时间
+     */
+    std::int64_t start_ns() const { return start_ns_; }
+
+private:
+    /**
+     * @brief 写入一条记录
+     */
+    void write_record(std::uint32_t session_id, CaptureRecord::Kind kind, std::string_view data);
+
+    std::FILE* file_ = nullptr;      ///< 抓包文件
+    std::int64_t start_ns_ = 0;      ///< 抓包开始的单调时间
+};
+
+/**
+ * @brief 顺序读取抓包文件
+ */
+class CaptureReader {
+public:
+    /**
+     * @brief 构造函数，打开抓包文件并校验文件头
+     * @param path 抓包文件路径
+     * @throws std::runtime_error 文件无法打开或不是抓包文件时抛出
+     */
+    explicit CaptureReader(const std::string& path);
+
+    /**
+     * @brief 析构函数，关闭文件
+     */
+    ~CaptureReader();
+
+    CaptureReader(const CaptureReader&) = delete;
+    CaptureReader& operator=(const CaptureReader&) = delete;
+
+    /**
+     * @brief 读取下一条记录
+     * @param record 输出的记录
+     * @return 到达文件末尾时返回 false，末尾写了一半的记录被忽略
+     */
+    bool next(CaptureRecord& record);
+
+    /**
+     * @brief 抓包开始的 Unix 毫秒时间
+     */
+    std::int64_t started_at_ms() const { return started_at_ms_; }
+
+private:
+    std::FILE* file_ = nullptr;     ///< 抓包文件
+    std::int64_t started_at_ms_ = 0;///< 抓包开始的 Unix 毫秒时间
+};
+
+#endif //HACK_CHAT_TRAFFICCAPTURE_H
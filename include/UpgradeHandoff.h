@@ -0,0 +1,36 @@
+//
+// Created by 穆琰鑫 on 2024/10/21.
+//
+
+#ifndef HACK_CHAT_UPGRADEHANDOFF_H
+#define HACK_CHAT_UPGRADEHANDOFF_H
+
+#include <string>
+#include <vector>
+
+// 平滑升级依赖 Unix 域套接字的 SCM_RIGHTS 传递文件描述符，仅在 POSIX 平台上可用
+#if !defined(_WIN32)
+#define HACK_CHAT_HAS_UPGRADE_HANDOFF 1
+#endif
+
+/**
+ * @brief 通过 Unix 域套接字把服务器状态和文件描述符交给新进程
+ *
+ * 先发送状态长度和描述符数量，再发送状态内容，最后分批通过 SCM_RIGHTS 发送描述符。
+ * @param unix_fd 已连接的 Unix 域套接字
+ * @param state 序列化后的会话与频道状态
+ * @param fds 需要移交的文件描述符，第一个是监听socket
+ * @return 全部发送成功返回 true
+ */
+bool send_upgrade_handoff(int unix_fd, const std::string& state, const std::vector<int>& fds);
+
+/**
+ * @brief 从旧进程接收服务器状态和文件描述符
+ * @param unix_fd 已连接的 Unix 域套接字
+ * @param state 输出，序列化后的会话与频道状态
+ * @param fds 输出，收到的文件描述符，顺序与发送端一致
+ * @return 全部接收成功返回 true
+ */
+bool receive_upgrade_handoff(int unix_fd, std::string& state, std::vector<int>& fds);
+
+#endif //HACK_CHAT_UPGRADEHANDOFF_H
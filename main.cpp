@@ -1,9 +1,69 @@
+#include <chrono>
+#include <cstdlib>
+#include <string>
 #include "include/ChatClientGUI.h"
 
+/*
+ * 解析毫秒数参数
+ * \param text 参数文本
+ * \param value 输出的毫秒数
+ * \return 是否为非负整数
+ */
+static bool parse_milliseconds(const char* text, std::chrono::milliseconds& value) {
+    char* end = nullptr;
+    long long count = std::strtoll(text, &end, 10);
+    if (end == text || *end != '\0' || count < 0) {
+        return false;
+    }
+    value = std::chrono::milliseconds(count);
+    return true;
+}
+
+/**
+ * @brief 客户端入口
+ *
+ * 用法: hack_chat [--trace-sample <rate>] [--resolve-timeout <ms>] [--connect-timeout <ms>]
+ *                 [--attempt-delay <ms>] [--reconnect-max <ms>] [--no-reconnect]
+ * --trace-sample 按 0 到 1 的比例对请求做延迟追踪，每分钟和退出时打印各阶段直方图；
+ * --resolve-timeout、--connect-timeout 分别限制域名解析和所有地址连接尝试的总时间；
+ * --attempt-delay 为 Happy Eyeballs 相邻地址尝试的错开时间；
+ * --reconnect-max 为断线重连退避的上限，--no-reconnect 关闭自动重连。
+ */
 int main(int argc, char** argv) {
     try {
+        double trace_sample_rate = 0;
+        ConnectOptions connect_options;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--trace-sample" && i + 1 < argc) {
+                char* end = nullptr;
+                trace_sample_rate = std::strtod(argv[++i], &end);
+                if (end == argv[i] || *end != '\0' || trace_sample_rate < 0 || trace_sample_rate > 1) {
+                    std::cerr << "Invalid --trace-sample, expected a rate between 0 and 1: " << argv[i] << std::endl;
+                    return EXIT_FAILURE;
+                }
+            } else if ((arg == "--resolve-timeout" || arg == "--connect-timeout" || arg == "--attempt-delay" ||
+                        arg == "--reconnect-max") && i + 1 < argc) {
+                std::chrono::milliseconds& value = arg == "--resolve-timeout" ? connect_options.resolve_timeout
+                                                 : arg == "--connect-timeout" ? connect_options.connect_timeout
+                                                 : arg == "--attempt-delay" ? connect_options.attempt_delay
+                                                 : connect_options.reconnect_max;
+                if (!parse_milliseconds(argv[++i], value)) {
+                    std::cerr << "Invalid " << arg << ", expected milliseconds: " << argv[i] << std::endl;
+                    return EXIT_FAILURE;
+                }
+            } else if (arg == "--no-reconnect") {
+                connect_options.auto_reconnect = false;
+            }
+        }
+
+        // 开启 FLTK 的多线程支持，网络线程通过 Fl::awake 把界面更新交给主线程
+        Fl::lock();
+
         // 创建并初始化 GUI 窗口
         ChatClientGUI chat_client(600, 400, "在线聊天室客户端");
+        chat_client.set_trace_sample_rate(trace_sample_rate);
+        chat_client.set_connect_options(connect_options);
 
         // 显示 GUI
         chat_client.show();
@@ -2,12 +2,25 @@
 // Created by 穆琰鑫 on 2024/10/15.
 //
 
+#include <cstdlib>
 #include <iostream>
+#include <memory>
 #include <vector>
 #include "include/NetWork.h"
 #include "include/ChatClientGUI.h"
 
-int main() {
+/**
+ * @brief 服务器入口
+ *
+ * 用法: server_main [--upgrade-socket <path>] [--takeover] [--history-db <path>] [--capture <path>]
+ *                    [--batch-window <channel>=<us>]...
+ * --upgrade-socket 指定平滑升级控制路径；--takeover 表示从该路径上正在运行的旧进程接管连接；
+ * --history-db 指定聊天记录数据库，默认为 hack_chat_history.db，回放测试可每次指定一个新文件；
+ * --capture 把入站流量记录到抓包文件，可用 traffic_replay 回放；
+ * --batch-window 设置频道的广播批量窗口（微秒），频道为 * 时作用于所有频道，可重复指定。
+ * 接管时沿用旧进程的数据库、抓包文件和批量窗口，命令行再指定的数据库和窗口会覆盖继承的设置。
+ */
+int main(int argc, char** argv) {
     try {
         //TODO 增加从json文件中读取服务器数据内容
 
@@ -15,15 +28,64 @@ int main() {
         short port = 12345;
         std::vector<std::string> channels = {"SciFi", "Tech", "General"};
 
-        // 创建服务器网络类对象
-        ServerNetwork server(port, channels);
+        std::string upgrade_path = "/tmp/hack_chat_upgrade.sock";
+        bool takeover = false;
+        std::string history_path;
+        std::string capture_path;
+        std::vector<std::pair<std::string, long>> batch_windows;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--upgrade-socket" && i + 1 < argc) {
+                upgrade_path = argv[++i];
+            } else if (arg == "--takeover") {
+                takeover = true;
+            } else if (arg == "--history-db" && i + 1 < argc) {
+                history_path = argv[++i];
+            } else if (arg == "--capture" && i + 1 < argc) {
+                capture_path = argv[++i];
+            } else if (arg == "--batch-window" && i + 1 < argc) {
+                std::string spec = argv[++i];
+                auto eq = spec.find('=');
+                const char* value = eq == std::string::npos ? "" : spec.c_str() + eq + 1;
+                char* end = nullptr;
+                long window_us = std::strtol(value, &end, 10);
+                if (eq == 0 || end == value || *end != '\0' || window_us < 0) {
+                    std::cerr << "Invalid --batch-window, expected <channel>=<microseconds>: " << spec << std::endl;
+                    return 1;
+                }
+                batch_windows.emplace_back(spec.substr(0, eq), window_us);
+            }
+        }
+
+        // 创建服务器网络类对象，升级时从旧进程接管监听socket和所有连接
+        std::unique_ptr<ServerNetwork> server;
+        if (takeover) {
+            server = std::make_unique<ServerNetwork>(upgrade_path);
+        } else {
+            server = std::make_unique<ServerNetwork>(port, channels);
+        }
+        if (!history_path.empty()) {
+            server->enable_history(history_path);
+        } else if (!takeover) {
+            server->enable_history("hack_chat_history.db");
+        }
+        server->enable_upgrade(upgrade_path);
+        if (!capture_path.empty()) {
+            server->enable_capture(capture_path);
+        }
+        for (const auto& [channel, window_us] : batch_windows) {
+            if (!server->set_broadcast_window(channel, std::chrono::microseconds(window_us))) {
+                std::cerr << "Invalid --batch-window, no such channel: " << channel << std::endl;
+                return 1;
+            }
+        }
 
         // 启动服务器，等待客户端连接
         std::cout << "Server is running on port " << port << "..." << std::endl;
-        server.run_server();
+        server->run_server();
     } catch (const std::exception& e) {
         std::cerr << "Server error: " << e.what() << std::endl;
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,59 @@
+//
+// Created by 穆琰鑫 on 2024/10/27.
+//
+
+#include "../include/ChannelRouter.h"
+
+bool ChannelRouter::subscribe(const std::string& channel, const std::string& username) {
+    auto it = subscribers_.find(channel);
+    if (it == subscribers_.end() || !it->second.insert(username).second) {
+        return false;
+    }
+    subscriptions_[username].insert(channel);
+    return true;
+}
+
+bool ChannelRouter::unsubscribe(const std::string& channel, const std::string& username) {
+    auto it = subscribers_.find(channel);
+    if (it == subscribers_.end() || it->second.erase(username) == 0) {
+        return false;
+    }
+    auto user_it = subscriptions_.find(username);
+    if (user_it != subscriptions_.end()) {
+        user_it->second.erase(channel);
+        if (user_it->second.empty()) subscriptions_.erase(user_it);
+    }
+    return true;
+}
+
+std::vector<std::string> ChannelRouter::unsubscribe_all(const std::string& username) {
+    std::vector<std::string> channels;
+    auto user_it = subscriptions_.find(username);
+    if (user_it == subscriptions_.end()) {
+        return channels;
+    }
+    for (const auto& channel : user_it->second) {
+        subscribers_[channel].erase(username);
+        channels.push_back(channel);
+    }
+    subscriptions_.erase(user_it);
+    return channels;
+}
+
+const ChannelRouter::SubscriberSet& ChannelRouter::subscribers(const std::string& channel) const {
+    static const SubscriberSet empty;
+    auto it = subscribers_.find(channel);
+    return it != subscribers_.end() ? it->second : empty;
+}
+
+std::vector<std::string> ChannelRouter::subscriptions(const std::string& username) const {
+    auto it = subscriptions_.find(username);
+    if (it == subscriptions_.end()) {
+        return {};
+    }
+    return {it->second.begin(), it->second.end()};
+}
+
+void ChannelRouter::add_channel(const std::string& channel) {
+    subscribers_[channel];
+}
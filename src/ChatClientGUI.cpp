@@ -23,9 +23,10 @@ ChatClientGUI::ChatClientGUI(int width, int height, const char *title)  {
 
     // 创建聊天界面 (chat_group)
     chat_group = new Fl_Group(10, 10, 580, 380);
-    chat_display = new Fl_Text_Display(10, 10, 400, 300);
-    text_buffer = new Fl_Text_Buffer();
-    chat_display->buffer(text_buffer);
+    // 频道标签页在订阅频道时动态添加
+    channel_tabs = new Fl_Tabs(10, 10, 400, 300);
+    channel_tabs->callback(tab_changed_cb, this);  // 标签页切换回调
+    channel_tabs->end();
 
     chat_input = new Fl_Input(10, 320, 400, 30);
     send_button = new Fl_Button(420, 320, 100, 30, "发送");
@@ -35,6 +36,10 @@ ChatClientGUI::ChatClientGUI(int width, int height, const char *title)  {
     return_button = new Fl_Button(420, 10, 100, 30, "返回");
     return_button->callback(return_cb, this);  // 返回按钮回调
 
+    // 添加退订按钮
+    leave_button = new Fl_Button(420, 50, 100, 30, "退订");
+    leave_button->callback(leave_cb, this);  // 退订按钮回调
+
     chat_group->end();
     chat_group->hide(); // 初始隐藏聊天界面
 
@@ -48,6 +53,14 @@ void ChatClientGUI::show() {
     window->show();
 }
 
+void ChatClientGUI::set_trace_sample_rate(double rate) {
+    trace_sample_rate_ = rate;
+}
+
+void ChatClientGUI::set_connect_options(const ConnectOptions& options) {
+    connect_options_ = options;
+}
+
 void ChatClientGUI::connect_cb(Fl_Widget *w, void *data) {
     ((ChatClientGUI*)data)->connect_server();
 }
@@ -63,39 +76,95 @@ void ChatClientGUI::connect_server() {
     }
     //TODO 增加服务器和端口的校验
 
+    // 重新连接前停止上一个连接的 I/O 线程
+    if (io_thread_.joinable()) {
+        client_network_->io_context_.stop();
+        io_thread_.join();
+    }
+    clear_tabs();
+
     // 初始化网络模块
     client_network_ = std::make_unique<ClientNetwork>(server, port, username);
+    client_network_->enable_history_cache("hack_chat_cache.db");
+    client_network_->set_trace_sample_rate(trace_sample_rate_);
+    client_network_->set_connect_options(connect_options_);
 
-    client_network_->setMessageCallback([this](const std::string& msg) {
+    // 网络回调在 I/O 线程中执行，界面更新都交给 GUI 线程
+    client_network_->setMessageCallback([this](const std::string& channel, const std::string& msg) {
         std::cout<<"message call back"<<std::endl;
-        Fl::lock();  // 确保线程安全地更新 GUI
-        this->text_buffer->append((msg + "\n").c_str());
-        Fl::unlock();
-        Fl::awake();  // 刷新 GUI
+        post_to_gui([this, channel, msg]() {
+            this->display_message(channel, msg);
+        });
     });
     client_network_->setChannelListCallback([this](const std::vector<std::string>& channels) {
-        Fl::lock();
-        this->channel_browser->clear();
-        for (const auto& channel : channels) {
-            this->channel_browser->add(channel.c_str());
-        }
-        Fl::unlock();
-        Fl::awake();
+        post_to_gui([this, channels]() {
+            this->channel_browser->clear();
+            for (const auto& channel : channels) {
+                this->channel_browser->add(channel.c_str());
+            }
+        });
     });
 
-    if (client_network_->connect_to_server()) {
-        client_network_->start_receiving();
-        // 启动 io_context 的线程
-        io_thread_ = std::thread([this]() {
-            client_network_->io_context_.run();
+    // GUI 任务按提交顺序执行，渲染耗时在同一回复的显示更新都完成后统计
+    client_network_->setRenderCallback([this](std::int64_t received_ns) {
+        post_to_gui([this, received_ns]() {
+            this->client_network_->record_render(received_ns);
         });
+    });
 
-        // 获取频道列表
-        boost::asio::post(client_network_->io_context_, [this]() {
-            client_network_->get_channel_list();
-        });
-    } else {
-        show_error("Failed to connect to server!");
+    client_network_->setConnectionCallback([this](ConnectionEvent event, const std::string& detail) {
+        switch (event) {
+            case ConnectionEvent::connected:
+                // 获取频道列表
+                client_network_->get_channel_list();
+                break;
+            case ConnectionEvent::failed:
+                // 错误窗口只能在主线程创建
+                post_to_gui([detail]() {
+                    show_error("Failed to connect to server: " + detail);
+                });
+                break;
+            case ConnectionEvent::disconnected:
+            case ConnectionEvent::reconnected: {
+                std::string notice = event == ConnectionEvent::disconnected
+                                     ? "[connection lost: " + detail + "]\n" : "[reconnected]\n";
+                post_to_gui([this, notice]() {
+                    for (auto& [channel, tab] : this->channel_tabs_) {
+                        tab.buffer->append(notice.c_str());
+                    }
+                });
+                break;
+            }
+        }
+    });
+
+    // 连接在 I/O 线程中异步完成，解析和连接都有超时，不会阻塞界面
+    client_network_->async_connect();
+    // 启动 io_context 的线程
+    io_thread_ = std::thread([this]() {
+        client_network_->io_context_.run();
+    });
+}
+
+void ChatClientGUI::post_to_gui(std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(gui_tasks_mutex_);
+    gui_tasks_.push_back(std::move(task));
+    // 一次通知执行所有已提交的更新，避免消息密集时占满 FLTK 的通知队列
+    if (!gui_tasks_posted_) {
+        gui_tasks_posted_ = Fl::awake(gui_tasks_cb, this) == 0;
+    }
+}
+
+void ChatClientGUI::gui_tasks_cb(void* data) {
+    auto* gui = static_cast<ChatClientGUI*>(data);
+    std::vector<std::function<void()>> tasks;
+    {
+        std::lock_guard<std::mutex> lock(gui->gui_tasks_mutex_);
+        tasks.swap(gui->gui_tasks_);
+        gui->gui_tasks_posted_ = false;
+    }
+    for (const auto& task : tasks) {
+        task();
     }
 }
 
@@ -106,9 +175,10 @@ void ChatClientGUI::channel_select_cb(Fl_Widget *w, void *data) {
 void ChatClientGUI::channel_selected(){
     int selected = channel_browser->value();
     if (selected > 0) {
-        const char* selected_channel = channel_browser->text(selected);
+        std::string selected_channel = channel_browser->text(selected);
+        // 先显示本地缓存，再订阅频道并请求缓存之后的新消息，已订阅的其他频道保持订阅
+        switch_to_chat(selected_channel.c_str());
         client_network_->join_channel(selected_channel);
-        switch_to_chat(selected_channel);
     }
 }
 
@@ -127,9 +197,49 @@ void ChatClientGUI::switch_to_chat(const char *channel_name) {
     main_group->hide();
     chat_group->show();
 
-    // 更新聊天显示（这里可以加载历史消息等）
-    std::string welcome_message = std::string("welcome ") + channel_name + "\n";
-    text_buffer->text(welcome_message.c_str());
+    // 切换到频道的标签页并清零未读数
+    ChannelTab& tab = open_tab(channel_name);
+    channel_tabs->value(tab.group);
+    tab.unread = 0;
+    update_tab_label(channel_name, tab);
+}
+
+void ChatClientGUI::tab_changed_cb(Fl_Widget *w, void *data) {
+    ((ChatClientGUI*)data)->tab_changed();
+}
+
+void ChatClientGUI::tab_changed() {
+    std::string channel = selected_channel();
+    if (channel.empty()) return;
+    ChannelTab& tab = channel_tabs_.at(channel);
+    tab.unread = 0;
+    update_tab_label(channel, tab);
+    client_network_->set_active_channel(channel);
+}
+
+void ChatClientGUI::leave_cb(Fl_Widget *w, void *data) {
+    ((ChatClientGUI*)data)->leave_channel();
+}
+
+void ChatClientGUI::leave_channel() {
+    std::string channel = selected_channel();
+    if (channel.empty()) return;
+    client_network_->unsubscribe_channel(channel);
+
+    ChannelTab tab = channel_tabs_.at(channel);
+    channel_tabs_.erase(channel);
+    channel_tabs->remove(tab.group);
+    delete tab.group;   // 同时删除其中的消息显示控件
+    delete tab.buffer;
+
+    if (channel_tabs->children() > 0) {
+        // 切换到剩下的第一个频道
+        channel_tabs->value(channel_tabs->child(0));
+        tab_changed();
+        channel_tabs->redraw();
+    } else {
+        switch_to_channel();
+    }
 }
 
 void ChatClientGUI::switch_to_channel() {
@@ -165,14 +275,90 @@ void ChatClientGUI::show_error(const std::string& error_message) {
 
 /**
  * @brief 将收到的消息添加到聊天窗口的显示缓冲区。
- * 此方法被设计为线程安全，可从多线程环境中调用。
+ * 只能在 GUI 线程调用，I/O 线程收到的消息经 post_to_gui 转交。
  * @param message 从服务器接收到的消息文本，将被添加到聊天界面中。
  */
-void ChatClientGUI::display_message(const std::string& message) {
-    Fl::lock();
-    std::string current_text = text_buffer->text();
-    current_text += message + "\n";
-    text_buffer->text(current_text.c_str());
-    Fl::unlock();
-    Fl::awake();
+void ChatClientGUI::display_message(const std::string& channel, const std::string& message) {
+    auto it = channel_tabs_.find(channel);
+    if (it != channel_tabs_.end()) {
+        ChannelTab& tab = it->second;
+        tab.buffer->append((message + "\n").c_str());
+        // 不在当前标签页或停留在频道选择界面时计为未读
+        if (channel_tabs->value() != tab.group || !chat_group->visible()) {
+            ++tab.unread;
+            update_tab_label(channel, tab);
+        }
+    }
+}
+
+/**
+ * @brief 创建频道的标签页并加载本地缓存的消息，已存在时直接返回
+ * @param channel 频道名
+ * @return 频道的标签页
+ */
+ChatClientGUI::ChannelTab& ChatClientGUI::open_tab(const std::string& channel) {
+    auto it = channel_tabs_.find(channel);
+    if (it != channel_tabs_.end()) {
+        return it->second;
+    }
+
+    // 标签页标题占用 25 像素，内容区域在其下方
+    ChannelTab tab;
+    channel_tabs->begin();
+    tab.group = new Fl_Group(10, 35, 400, 275);
+    tab.display = new Fl_Text_Display(10, 35, 400, 275);
+    tab.buffer = new Fl_Text_Buffer();
+    tab.display->buffer(tab.buffer);
+    tab.group->end();
+    channel_tabs->end();
+    // end() 会把当前组恢复为聊天界面，之后创建的错误窗口不能被加入其中
+    Fl_Group::current(nullptr);
+
+    // 立即加载本地缓存的历史消息
+    std::string welcome_message = "welcome " + channel + "\n";
+    for (const auto& line : client_network_->cached_messages(channel)) {
+        welcome_message += line + "\n";
+    }
+    tab.buffer->text(welcome_message.c_str());
+
+    ChannelTab& inserted = channel_tabs_.emplace(channel, tab).first->second;
+    update_tab_label(channel, inserted);
+    return inserted;
+}
+
+/**
+ * @brief 当前选中的标签页对应的频道
+ * @return 频道名，没有标签页时为空
+ */
+std::string ChatClientGUI::selected_channel() {
+    Fl_Widget* selected = channel_tabs->value();
+    for (const auto& [channel, tab] : channel_tabs_) {
+        if (tab.group == selected) {
+            return channel;
+        }
+    }
+    return "";
+}
+
+/**
+ * @brief 更新标签页标题，有未读消息时显示未读数
+ * @param channel 频道名
+ * @param tab 频道的标签页
+ */
+void ChatClientGUI::update_tab_label(const std::string& channel, ChannelTab& tab) {
+    std::string label = tab.unread > 0 ? channel + " (" + std::to_string(tab.unread) + ")" : channel;
+    tab.group->copy_label(label.c_str());
+    channel_tabs->redraw();
+}
+
+/**
+ * @brief 关闭所有标签页，重新连接时调用
+ */
+void ChatClientGUI::clear_tabs() {
+    for (auto& [channel, tab] : channel_tabs_) {
+        channel_tabs->remove(tab.group);
+        delete tab.group;
+        delete tab.buffer;
+    }
+    channel_tabs_.clear();
 }
\ No newline at end of file
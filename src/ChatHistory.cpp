@@ -0,0 +1,443 @@
+//
+// Created by 穆琰鑫 on 2024/10/22.
+//
+
+#include "../include/ChatHistory.h"
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+
+/// 短查询无法使用 trigram 索引，只扫描频道内最近的这些消息
+static constexpr std::size_t kScanWindow = 5000;
+/// 索引搜索只在频道内最近的这些匹配中排序，高频词的搜索耗时不随语料增长
+static constexpr std::size_t kSearchWindow = 1000;
+/// 数据库结构版本，保存在 PRAGMA user_version 中
+static constexpr int kSchemaVersion = 1;
+
+/*
+ * 计算 UTF-8 字符串中的字符数
+ */
+static std::size_t utf8_length(const std::string& text) {
+    std::size_t length = 0;
+    for (unsigned char c : text) {
+        if ((c & 0xC0) != 0x80) ++length;
+    }
+    return length;
+}
+
+/*
+ * 把用户输入转成 FTS5 短语查询，避免输入中的运算符和引号引起语法错误
+ */
+static std::string to_phrase_query(const std::string& query) {
+    std::string phrase = "\"";
+    for (char c : query) {
+        if (c == '"') phrase += '"';
+        phrase += c;
+    }
+    phrase += '"';
+    return phrase;
+}
+
+/*
+ * 生成索引中的频道标记：频道名的十六进制两侧加 #，
+ * 短语查询整个标记时只会命中同名频道，且不受 trigram 至少三个字符的限制
+ */
+static std::string channel_token(const std::string& channel) {
+    static const char* digits = "0123456789ABCDEF";
+    std::string token = "#";
+    for (unsigned char c : channel) {
+        token += digits[c >> 4];
+        token += digits[c & 0x0F];
+    }
+    token += '#';
+    return token;
+}
+
+/*
+ * 读取查询结果中的文本列，NULL 返回空字符串
+ */
+static std::string column_text(sqlite3_stmt* stmt, int column) {
+    const unsigned char* text = sqlite3_column_text(stmt, column);
+    return text ? reinterpret_cast<const char*>(text) : "";
+}
+
+ChatHistory::ChatHistory(const std::string& db_path, std::size_t batch_size, std::chrono::milliseconds flush_interval)
+        : batch_size_(batch_size), flush_interval_(flush_interval) {
+    if (sqlite3_open(db_path.c_str(), &db_) != SQLITE_OK) {
+        std::string error = db_ ? sqlite3_errmsg(db_) : "out of memory";
+        sqlite3_close(db_);
+        throw std::runtime_error("failed to open history database " + db_path + ": " + error);
+    }
+
+    // 平滑升级时旧进程可能仍在写入最后一批消息，等待其释放锁而不是立即失败
+    sqlite3_busy_timeout(db_, 5000);
+
+    try {
+        // WAL 模式下批量写入不会阻塞读，NORMAL 同步级别在 WAL 下仍能保证数据库一致
+        exec("PRAGMA journal_mode=WAL");
+        exec("PRAGMA synchronous=NORMAL");
+        exec("CREATE TABLE IF NOT EXISTS messages ("
+             "id INTEGER PRIMARY KEY, channel TEXT NOT NULL, seq INTEGER NOT NULL, "
+             "sender TEXT NOT NULL, content TEXT NOT NULL, ts INTEGER NOT NULL)");
+        exec("CREATE UNIQUE INDEX IF NOT EXISTS messages_channel_seq ON messages(channel, seq)");
+        migrate_index();
+        load_epoch();
+
+        const char* insert_message_sql =
+                "INSERT INTO messages(channel, seq, sender, content, ts) VALUES(?1, ?2, ?3, ?4, ?5)";
+        const char* insert_index_sql = "INSERT INTO messages_fts(rowid, channel, content) VALUES(?1, ?2, ?3)";
+        // 频道标记和查询文本同时在索引中求交，按 rowid 倒序取最近的 ?5 条匹配，只在其中排序。
+        // 内置 bm25() 要遍历短语的全部匹配计算 IDF，单个短语的 IDF 对所有结果相同，
+        // 因此只用词频和正文长度按 BM25（k1 = 1.2，b = 0.75）计分，排序与 bm25() 一致
+        const char* search_sql =
+                "WITH c AS (SELECT rowid AS id FROM messages_fts WHERE messages_fts MATCH ?1 "
+                "ORDER BY rowid DESC LIMIT ?5), "
+                "s AS (SELECT m.id, m.seq, m.sender, m.content, m.ts, "
+                "(length(m.content) - length(replace(lower(m.content), lower(?6), ''))) * 1.0 / length(?6) AS tf, "
+                "length(m.content) AS len, avg(length(m.content)) OVER () AS avg_len "
+                "FROM c CROSS JOIN messages m ON m.id = c.id WHERE m.channel = ?2) "
+                "SELECT seq, sender, content, ts, -(tf * 2.2) / (tf + 1.2 * (0.25 + 0.75 * len / avg_len)) AS score "
+                "FROM s ORDER BY score, id DESC LIMIT ?3 OFFSET ?4";
+        // 按序号倒序只扫描频道内最近的 ?5 条消息，扫描量有上界
+        const char* scan_sql =
+                "SELECT seq, sender, content, ts, 0.0 FROM messages "
+                "WHERE channel = ?2 AND seq > (SELECT IFNULL(MAX(seq), 0) FROM messages WHERE channel = ?2) - ?5 "
+                "AND instr(content, ?1) > 0 ORDER BY seq DESC LIMIT ?3 OFFSET ?4";
+        const char* fetch_sql =
+                "SELECT seq, sender, content, ts FROM messages "
+                "WHERE channel = ?1 AND seq > ?2 ORDER BY seq DESC LIMIT ?3";
+        if (sqlite3_prepare_v2(db_, insert_message_sql, -1, &insert_message_, nullptr) != SQLITE_OK ||
+            sqlite3_prepare_v2(db_, insert_index_sql, -1, &insert_index_, nullptr) != SQLITE_OK ||
+            sqlite3_prepare_v2(db_, fetch_sql, -1, &fetch_, nullptr) != SQLITE_OK) {
+            throw std::runtime_error(std::string("failed to prepare history statements: ") + sqlite3_errmsg(db_));
+        }
+
+        // 搜索使用独立的只读连接，WAL 模式下与写入互不阻塞
+        if (sqlite3_open_v2(db_path.c_str(), &search_db_, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+            throw std::runtime_error("failed to open history database " + db_path + " for search: " +
+                                     (search_db_ ? sqlite3_errmsg(search_db_) : "out of memory"));
+        }
+        sqlite3_busy_timeout(search_db_, 5000);
+        if (sqlite3_prepare_v2(search_db_, search_sql, -1, &search_, nullptr) != SQLITE_OK ||
+            sqlite3_prepare_v2(search_db_, scan_sql, -1, &scan_, nullptr) != SQLITE_OK) {
+            throw std::runtime_error(std::string("failed to prepare search statements: ") +
+                                     sqlite3_errmsg(search_db_));
+        }
+        load_sequences();
+    } catch (...) {
+        sqlite3_finalize(insert_message_);
+        sqlite3_finalize(insert_index_);
+        sqlite3_finalize(search_);
+        sqlite3_finalize(scan_);
+        sqlite3_finalize(fetch_);
+        sqlite3_close(search_db_);
+        sqlite3_close(db_);
+        throw;
+    }
+
+    worker_ = std::thread([this]() { worker_loop(); });
+    search_worker_ = std::thread([this]() { search_loop(); });
+}
+
+ChatHistory::~ChatHistory() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_one();
+    search_wake_.notify_one();
+    // 搜索线程可能在等待后台线程写入，先等它执行完剩余的搜索
+    search_worker_.join();
+    worker_.join();
+
+    sqlite3_finalize(insert_message_);
+    sqlite3_finalize(insert_index_);
+    sqlite3_finalize(search_);
+    sqlite3_finalize(scan_);
+    sqlite3_finalize(fetch_);
+    sqlite3_close(search_db_);
+    sqlite3_close(db_);
+}
+
+std::uint64_t ChatHistory::append(std::string_view channel, std::string_view sender, std::string_view content) {
+    std::uint64_t seq = ++last_seq_[std::string(channel)];
+    HistoryRecord record;
+    record.seq = seq;
+    record.channel = channel;
+    record.sender = sender;
+    record.content = content;
+    record.timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.push_back(std::move(record));
+        ++appended_;
+        full = pending_.size() >= batch_size_;
+    }
+    // 未满一批时由后台线程按时间间隔自行写入，减少唤醒次数
+    if (full) wake_.notify_one();
+    return seq;
+}
+
+void ChatHistory::search(const std::string& channel, const std::string& query, std::size_t page,
+                         std::size_t page_size, SearchCallback callback) {
+    auto task = [this, channel, query, page, page_size, callback = std::move(callback)]() {
+        // trigram 索引无法匹配少于三个字符的查询，此时退化为频道内最近消息的子串扫描，按时间倒序返回
+        bool use_index = utf8_length(query) >= 3;
+        sqlite3_stmt* stmt = use_index ? search_ : scan_;
+        std::string match = use_index ? "channel:\"" + channel_token(channel) + "\" AND content:" +
+                                        to_phrase_query(query) : query;
+
+        sqlite3_bind_text(stmt, 1, match.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, channel.c_str(), -1, SQLITE_TRANSIENT);
+        // 多取一条用于判断是否还有下一页
+        sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(page_size + 1));
+        sqlite3_bind_int64(stmt, 4, static_cast<sqlite3_int64>(page * page_size));
+        sqlite3_bind_int64(stmt, 5, static_cast<sqlite3_int64>(use_index ? kSearchWindow : kScanWindow));
+        if (use_index) {
+            sqlite3_bind_text(stmt, 6, query.c_str(), -1, SQLITE_TRANSIENT);
+        }
+
+        std::vector<HistoryRecord> records;
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            HistoryRecord record;
+            record.seq = static_cast<std::uint64_t>(sqlite3_column_int64(stmt, 0));
+            record.channel = channel;
+            record.sender = column_text(stmt, 1);
+            record.content = column_text(stmt, 2);
+            record.timestamp = sqlite3_column_int64(stmt, 3);
+            record.rank = sqlite3_column_double(stmt, 4);
+            records.push_back(std::move(record));
+        }
+        if (rc != SQLITE_DONE) {
+            std::cerr << "[History] Search failed: " << sqlite3_errmsg(search_db_) << std::endl;
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+
+        bool has_more = records.size() > page_size;
+        if (has_more) records.pop_back();
+        callback(std::move(records), has_more);
+    };
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        search_tasks_.emplace_back(appended_, std::move(task));
+    }
+    search_wake_.notify_one();
+}
+
+void ChatHistory::fetch_after(const std::string& channel, std::uint64_t after_seq, std::size_t limit,
+                              FetchCallback callback) {
+    auto task = [this, channel, after_seq, limit, callback = std::move(callback)]() {
+        sqlite3_bind_text(fetch_, 1, channel.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(fetch_, 2, static_cast<sqlite3_int64>(after_seq));
+        // 多取一条用于判断是否有更早的消息被截断
+        sqlite3_bind_int64(fetch_, 3, static_cast<sqlite3_int64>(limit + 1));
+
+        std::vector<HistoryRecord> records;
+        int rc;
+        while ((rc = sqlite3_step(fetch_)) == SQLITE_ROW) {
+            HistoryRecord record;
+            record.seq = static_cast<std::uint64_t>(sqlite3_column_int64(fetch_, 0));
+            record.channel = channel;
+            record.sender = column_text(fetch_, 1);
+            record.content = column_text(fetch_, 2);
+            record.timestamp = sqlite3_column_int64(fetch_, 3);
+            records.push_back(std::move(record));
+        }
+        if (rc != SQLITE_DONE) {
+            std::cerr << "[History] Fetch failed: " << sqlite3_errmsg(db_) << std::endl;
+        }
+        sqlite3_reset(fetch_);
+        sqlite3_clear_bindings(fetch_);
+
+        bool truncated = records.size() > limit;
+        if (truncated) records.pop_back();
+        std::reverse(records.begin(), records.end());
+        callback(std::move(records), truncated);
+    };
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+    }
+    wake_.notify_one();
+}
+
+void ChatHistory::flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::uint64_t target = appended_;
+    flush_requested_ = true;
+    wake_.notify_one();
+    flushed_.wait(lock, [this, target]() { return written_ >= target; });
+}
+
+void ChatHistory::worker_loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        wake_.wait_for(lock, flush_interval_, [this]() {
+            return stopping_ || !tasks_.empty() || pending_.size() >= batch_size_ || flush_requested_;
+        });
+        flush_requested_ = false;
+
+        // 查询前先写入已排队的消息，保证查询能看到此前追加的内容
+        if (!pending_.empty()) {
+            std::vector<HistoryRecord> batch;
+            batch.swap(pending_);
+            lock.unlock();
+            write_batch(batch);
+            lock.lock();
+            written_ += batch.size();
+            flushed_.notify_all();
+        }
+
+        while (!tasks_.empty()) {
+            auto task = std::move(tasks_.front());
+            tasks_.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+
+        if (stopping_ && pending_.empty() && tasks_.empty()) break;
+    }
+}
+
+void ChatHistory::search_loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        search_wake_.wait(lock, [this]() { return stopping_ || !search_tasks_.empty(); });
+        if (search_tasks_.empty()) break;
+
+        auto [target, task] = std::move(search_tasks_.front());
+        search_tasks_.pop_front();
+        // 搜索前等待提交时已追加的消息写入数据库，不必等到下一个写入间隔
+        if (written_ < target) {
+            flush_requested_ = true;
+            wake_.notify_one();
+            flushed_.wait(lock, [this, target = target]() { return written_ >= target; });
+        }
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+void ChatHistory::write_batch(const std::vector<HistoryRecord>& batch) {
+    try {
+        exec("BEGIN");
+    } catch (const std::exception& e) {
+        std::cerr << "[History] " << e.what() << std::endl;
+        return;
+    }
+
+    for (const auto& record : batch) {
+        sqlite3_bind_text(insert_message_, 1, record.channel.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(insert_message_, 2, static_cast<sqlite3_int64>(record.seq));
+        sqlite3_bind_text(insert_message_, 3, record.sender.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(insert_message_, 4, record.content.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(insert_message_, 5, record.timestamp);
+        if (sqlite3_step(insert_message_) == SQLITE_DONE) {
+            std::string token = channel_token(record.channel);
+            sqlite3_bind_int64(insert_index_, 1, sqlite3_last_insert_rowid(db_));
+            sqlite3_bind_text(insert_index_, 2, token.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(insert_index_, 3, record.content.c_str(), -1, SQLITE_STATIC);
+            if (sqlite3_step(insert_index_) != SQLITE_DONE) {
+                std::cerr << "[History] Failed to index message: " << sqlite3_errmsg(db_) << std::endl;
+            }
+            sqlite3_reset(insert_index_);
+        } else {
+            std::cerr << "[History] Failed to store message: " << sqlite3_errmsg(db_) << std::endl;
+        }
+        sqlite3_reset(insert_message_);
+    }
+
+    try {
+        exec("COMMIT");
+    } catch (const std::exception& e) {
+        std::cerr << "[History] " << e.what() << std::endl;
+        sqlite3_exec(db_, "ROLLBACK", nullptr, nullptr, nullptr);
+    }
+}
+
+void ChatHistory::exec(const char* sql) {
+    char* error = nullptr;
+    if (sqlite3_exec(db_, sql, nullptr, nullptr, &error) != SQLITE_OK) {
+        std::string message = error ? error : "unknown error";
+        sqlite3_free(error);
+        throw std::runtime_error(std::string("sqlite error in \"") + sql + "\": " + message);
+    }
+}
+
+void ChatHistory::load_sequences() {
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db_, "SELECT channel, MAX(seq) FROM messages GROUP BY channel", -1, &stmt,
+                           nullptr) != SQLITE_OK) {
+        throw std::runtime_error(std::string("failed to load sequences: ") + sqlite3_errmsg(db_));
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        last_seq_[column_text(stmt, 0)] = static_cast<std::uint64_t>(sqlite3_column_int64(stmt, 1));
+    }
+    sqlite3_finalize(stmt);
+}
+
+void ChatHistory::migrate_index() {
+    sqlite3_stmt* stmt = nullptr;
+    int version = 0;
+    if (sqlite3_prepare_v2(db_, "PRAGMA user_version", -1, &stmt, nullptr) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    if (version >= kSchemaVersion) return;
+
+    // 旧版索引只有正文列，无法按频道过滤，按现有消息重建
+    exec("BEGIN");
+    try {
+        exec("DROP TABLE IF EXISTS messages_fts");
+        // 无内容表只保存索引，正文仍存放在 messages 中；trigram 分词支持中文子串搜索
+        exec("CREATE VIRTUAL TABLE messages_fts USING fts5(channel, content, content='', tokenize='trigram')");
+        exec("INSERT INTO messages_fts(rowid, channel, content) "
+             "SELECT id, '#' || hex(channel) || '#', content FROM messages");
+        exec(("PRAGMA user_version=" + std::to_string(kSchemaVersion)).c_str());
+        exec("COMMIT");
+    } catch (...) {
+        sqlite3_exec(db_, "ROLLBACK", nullptr, nullptr, nullptr);
+        throw;
+    }
+}
+
+void ChatHistory::load_epoch() {
+    exec("CREATE TABLE IF NOT EXISTS meta (key TEXT PRIMARY KEY, value TEXT NOT NULL)");
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db_, "SELECT value FROM meta WHERE key = 'epoch'", -1, &stmt, nullptr) != SQLITE_OK) {
+        throw std::runtime_error(std::string("failed to load history epoch: ") + sqlite3_errmsg(db_));
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        epoch_ = column_text(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    if (!epoch_.empty()) return;
+
+    // 新建的数据库序号从 1 重新开始，用随机纪元让客户端缓存失效
+    std::random_device random;
+    std::uint64_t value = (static_cast<std::uint64_t>(random()) << 32) | random();
+    static const char* digits = "0123456789abcdef";
+    for (int shift = 60; shift >= 0; shift -= 4) {
+        epoch_ += digits[(value >> shift) & 0x0F];
+    }
+    if (sqlite3_prepare_v2(db_, "INSERT INTO meta(key, value) VALUES('epoch', ?1)", -1, &stmt, nullptr) != SQLITE_OK) {
+        throw std::runtime_error(std::string("failed to store history epoch: ") + sqlite3_errmsg(db_));
+    }
+    sqlite3_bind_text(stmt, 1, epoch_.c_str(), -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        throw std::runtime_error(std::string("failed to store history epoch: ") + sqlite3_errmsg(db_));
+    }
+}
@@ -0,0 +1,183 @@
+//
+// Created by 穆琰鑫 on 2024/10/25.
+//
+
+#include "../include/HistoryCache.h"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+/// 缓存结构版本，保存在 PRAGMA user_version 中
+static constexpr int kCacheSchemaVersion = 1;
+
+/*
+ * 读取查询结果中的文本列，NULL 返回空字符串
+ */
+static std::string column_text(sqlite3_stmt* stmt, int column) {
+    const unsigned char* text = sqlite3_column_text(stmt, column);
+    return text ? reinterpret_cast<const char*>(text) : "";
+}
+
+HistoryCache::HistoryCache(const std::string& db_path) {
+    if (sqlite3_open(db_path.c_str(), &db_) != SQLITE_OK) {
+        std::string error = db_ ? sqlite3_errmsg(db_) : "out of memory";
+        sqlite3_close(db_);
+        throw std::runtime_error("failed to open history cache " + db_path + ": " + error);
+    }
+
+    // 早期版本的缓存不含纪元，缓存随时可以丢弃，结构版本不同时直接重建
+    sqlite3_stmt* version_stmt = nullptr;
+    int version = 0;
+    if (sqlite3_prepare_v2(db_, "PRAGMA user_version", -1, &version_stmt, nullptr) == SQLITE_OK &&
+        sqlite3_step(version_stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int(version_stmt, 0);
+    }
+    sqlite3_finalize(version_stmt);
+    if (version != kCacheSchemaVersion) {
+        sqlite3_exec(db_, "DROP TABLE IF EXISTS cached_messages", nullptr, nullptr, nullptr);
+    }
+
+    const char* schema =
+            "PRAGMA journal_mode=WAL;"
+            "PRAGMA synchronous=NORMAL;"
+            "CREATE TABLE IF NOT EXISTS cached_epochs ("
+            "server TEXT PRIMARY KEY, epoch TEXT NOT NULL) WITHOUT ROWID;"
+            "CREATE TABLE IF NOT EXISTS cached_messages ("
+            "server TEXT NOT NULL, epoch TEXT NOT NULL, channel TEXT NOT NULL, seq INTEGER NOT NULL, "
+            "sender TEXT NOT NULL, content TEXT NOT NULL, ts INTEGER NOT NULL, "
+            "PRIMARY KEY(server, epoch, channel, seq)) WITHOUT ROWID;";
+    const char* insert_sql =
+            "INSERT OR REPLACE INTO cached_messages(server, epoch, channel, seq, sender, content, ts) "
+            "VALUES(?1, ?2, ?3, ?4, ?5, ?6, ?7)";
+    const char* recent_sql =
+            "SELECT seq, sender, content, ts FROM cached_messages "
+            "WHERE server = ?1 AND epoch = ?2 AND channel = ?3 ORDER BY seq DESC LIMIT ?4";
+    const char* last_seq_sql =
+            "SELECT MAX(seq) FROM cached_messages WHERE server = ?1 AND epoch = ?2 AND channel = ?3";
+    const char* epoch_sql = "SELECT epoch FROM cached_epochs WHERE server = ?1";
+
+    char* error = nullptr;
+    if (sqlite3_exec(db_, schema, nullptr, nullptr, &error) != SQLITE_OK ||
+        sqlite3_prepare_v2(db_, insert_sql, -1, &insert_, nullptr) != SQLITE_OK ||
+        sqlite3_prepare_v2(db_, recent_sql, -1, &recent_, nullptr) != SQLITE_OK ||
+        sqlite3_prepare_v2(db_, last_seq_sql, -1, &last_seq_, nullptr) != SQLITE_OK ||
+        sqlite3_prepare_v2(db_, epoch_sql, -1, &epoch_, nullptr) != SQLITE_OK) {
+        std::string message = error ? error : sqlite3_errmsg(db_);
+        sqlite3_free(error);
+        sqlite3_finalize(insert_);
+        sqlite3_finalize(recent_);
+        sqlite3_finalize(last_seq_);
+        sqlite3_finalize(epoch_);
+        sqlite3_close(db_);
+        throw std::runtime_error("failed to initialize history cache: " + message);
+    }
+    sqlite3_exec(db_, ("PRAGMA user_version=" + std::to_string(kCacheSchemaVersion)).c_str(), nullptr, nullptr,
+                 nullptr);
+}
+
+HistoryCache::~HistoryCache() {
+    sqlite3_finalize(insert_);
+    sqlite3_finalize(recent_);
+    sqlite3_finalize(last_seq_);
+    sqlite3_finalize(epoch_);
+    sqlite3_close(db_);
+}
+
+std::vector<HistoryRecord> HistoryCache::load_recent(const std::string& server, const std::string& epoch,
+                                                     const std::string& channel, std::size_t limit) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sqlite3_bind_text(recent_, 1, server.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(recent_, 2, epoch.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(recent_, 3, channel.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(recent_, 4, static_cast<sqlite3_int64>(limit));
+
+    std::vector<HistoryRecord> records;
+    while (sqlite3_step(recent_) == SQLITE_ROW) {
+        HistoryRecord record;
+        record.seq = static_cast<std::uint64_t>(sqlite3_column_int64(recent_, 0));
+        record.channel = channel;
+        record.sender = column_text(recent_, 1);
+        record.content = column_text(recent_, 2);
+        record.timestamp = sqlite3_column_int64(recent_, 3);
+        records.push_back(std::move(record));
+    }
+    sqlite3_reset(recent_);
+    sqlite3_clear_bindings(recent_);
+
+    std::reverse(records.begin(), records.end());
+    return records;
+}
+
+std::uint64_t HistoryCache::last_seq(const std::string& server, const std::string& epoch,
+                                     const std::string& channel) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sqlite3_bind_text(last_seq_, 1, server.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(last_seq_, 2, epoch.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(last_seq_, 3, channel.c_str(), -1, SQLITE_TRANSIENT);
+
+    std::uint64_t seq = 0;
+    if (sqlite3_step(last_seq_) == SQLITE_ROW) {
+        seq = static_cast<std::uint64_t>(sqlite3_column_int64(last_seq_, 0));
+    }
+    sqlite3_reset(last_seq_);
+    sqlite3_clear_bindings(last_seq_);
+    return seq;
+}
+
+void HistoryCache::store(const std::string& server, const std::string& epoch,
+                         const std::vector<HistoryRecord>& records) {
+    if (records.empty()) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    sqlite3_exec(db_, "BEGIN", nullptr, nullptr, nullptr);
+    for (const auto& record : records) {
+        sqlite3_bind_text(insert_, 1, server.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(insert_, 2, epoch.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(insert_, 3, record.channel.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(insert_, 4, static_cast<sqlite3_int64>(record.seq));
+        sqlite3_bind_text(insert_, 5, record.sender.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(insert_, 6, record.content.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(insert_, 7, record.timestamp);
+        if (sqlite3_step(insert_) != SQLITE_DONE) {
+            std::cerr << "[Cache] Failed to store message: " << sqlite3_errmsg(db_) << std::endl;
+        }
+        sqlite3_reset(insert_);
+    }
+    sqlite3_exec(db_, "COMMIT", nullptr, nullptr, nullptr);
+}
+
+std::string HistoryCache::epoch(const std::string& server) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sqlite3_bind_text(epoch_, 1, server.c_str(), -1, SQLITE_TRANSIENT);
+
+    std::string epoch;
+    if (sqlite3_step(epoch_) == SQLITE_ROW) {
+        epoch = column_text(epoch_, 0);
+    }
+    sqlite3_reset(epoch_);
+    sqlite3_clear_bindings(epoch_);
+    return epoch;
+}
+
+void HistoryCache::set_epoch(const std::string& server, const std::string& epoch) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_exec(db_, "BEGIN", nullptr, nullptr, nullptr);
+    // 旧纪元的序号与新纪元无关，直接删除
+    if (sqlite3_prepare_v2(db_, "DELETE FROM cached_messages WHERE server = ?1 AND epoch <> ?2", -1, &stmt,
+                           nullptr) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, server.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, epoch.c_str(), -1, SQLITE_STATIC);
+        sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+    if (sqlite3_prepare_v2(db_, "INSERT OR REPLACE INTO cached_epochs(server, epoch) VALUES(?1, ?2)", -1, &stmt,
+                           nullptr) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, server.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, epoch.c_str(), -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            std::cerr << "[Cache] Failed to store epoch: " << sqlite3_errmsg(db_) << std::endl;
+        }
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_exec(db_, "COMMIT", nullptr, nullptr, nullptr);
+}
@@ -0,0 +1,59 @@
+//
+// Created by 穆琰鑫 on 2024/10/24.
+//
+
+#include "../include/LatencyTrace.h"
+#include <algorithm>
+#include <chrono>
+
+std::int64_t monotonic_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void LatencyHistogram::record(std::int64_t nanoseconds) {
+    nanoseconds = std::max<std::int64_t>(nanoseconds, 0);
+    auto microseconds = static_cast<std::uint64_t>(nanoseconds / 1000);
+
+    // 桶序号为微秒数的二进制位数，0 微秒落在第 0 个桶
+    std::size_t bucket = 0;
+    while (microseconds > 1 && bucket + 1 < kBuckets) {
+        microseconds >>= 1;
+        ++bucket;
+    }
+    ++buckets_[bucket];
+    ++count_;
+    sum_ns_ += nanoseconds;
+    max_ns_ = std::max(max_ns_, nanoseconds);
+}
+
+std::uint64_t LatencyHistogram::percentile_us(double quantile) const {
+    if (count_ == 0) return 0;
+    auto target = static_cast<std::uint64_t>(quantile * static_cast<double>(count_));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < kBuckets; ++i) {
+        seen += buckets_[i];
+        if (seen > target) {
+            return std::uint64_t(1) << (i + 1);
+        }
+    }
+    return static_cast<std::uint64_t>(max_ns_ / 1000);
+}
+
+nlohmann::json LatencyHistogram::to_json() const {
+    nlohmann::json buckets = nlohmann::json::object();
+    for (std::size_t i = 0; i < kBuckets; ++i) {
+        if (buckets_[i] != 0) {
+            buckets["le_" + std::to_string(std::uint64_t(1) << (i + 1)) + "us"] = buckets_[i];
+        }
+    }
+    return {
+            {"count", count_},
+            {"mean_us", count_ ? static_cast<double>(sum_ns_) / static_cast<double>(count_) / 1000.0 : 0.0},
+            {"p50_us", percentile_us(0.50)},
+            {"p90_us", percentile_us(0.90)},
+            {"p99_us", percentile_us(0.99)},
+            {"max_us", static_cast<double>(max_ns_) / 1000.0},
+            {"buckets", buckets}
+    };
+}
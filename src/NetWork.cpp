@@ -6,33 +6,55 @@
 #include <boost/asio/connect.hpp>
 #include <boost/asio/read_until.hpp>
 #include <boost/asio/write.hpp>
+#include <algorithm>
+#include <cstring>
 #include <sstream>
 #include <utility>
 
+#ifdef HACK_CHAT_HAS_UPGRADE_HANDOFF
+#include <unistd.h>
+#endif
+
+/// 客户端最多等待回复的追踪请求数
+static constexpr std::size_t kMaxPendingTraces = 1024;
+/// 客户端打印延迟直方图的间隔
+static constexpr std::chrono::seconds kTraceReportInterval{60};
+/// 客户端等待历史回复的时间，超过后重新请求
+static constexpr std::chrono::seconds kHistoryRetryInterval{5};
+
 /*
  * 检验服务器IP地址或域名，返回 std::optional<std::string>
  * \param input 输入待检验的ip地址
- * \return 如果是 IPv4 地址返回 "ipv4"，如果是域名返回 "domain"，否则返回 std::nullopt
+ * \return 如果是 IPv4 地址返回 "ipv4"，IPv6 地址返回 "ipv6"，如果是域名返回 "domain"，否则返回 std::nullopt
  */
 std::optional<std::string> validate_ip_or_hostname(const std::string& input) {
-    // 检验 IPv4 地址
-    const std::regex ipv4_pattern(
+    // 检验 IPv4 地址，正则只在首次调用时编译
+    static const std::regex ipv4_pattern(
             R"(^((25[0-5]|2[0-4][0-9]|[01]?[0-9][0-9]?)\.){3}(25[0-5]|2[0-4][0-9]|[01]?[0-9][0-9]?)$)");
 
     // 检验域名
-    const std::regex hostname_pattern(
+    static const std::regex hostname_pattern(
             R"(^(([a-zA-Z0-9](-?[a-zA-Z0-9])*)\.)+[a-zA-Z]{2,}$)");
 
     // 如果输入是合法的 IPv4 地址，返回 "ipv4"
     if (std::regex_match(input, ipv4_pattern)) {
         return "ipv4";
     }
-        // 如果输入是合法的域名，返回 "domain"
-    else if (std::regex_match(input, hostname_pattern)) {
+    // IPv6 地址含冒号，交给地址解析函数校验，支持压缩写法和 IPv4 映射地址
+    if (input.find(':') != std::string::npos) {
+        boost::system::error_code ec;
+        boost::asio::ip::make_address_v6(input, ec);
+        if (!ec) {
+            return "ipv6";
+        }
+        return std::nullopt;
+    }
+    // 如果输入是合法的域名，返回 "domain"
+    if (std::regex_match(input, hostname_pattern)) {
         return "domain";
     }
 
-    // 如果既不是合法的 IPv4 地址，也不是合法的域名，返回 std::nullopt
+    // 如果既不是合法的 IP 地址，也不是合法的域名，返回 std::nullopt
     return std::nullopt;
 }
 
@@ -50,11 +72,176 @@ bool validate_port(const std::string& port) {
     }
 }
 
+/**
+ * @brief 把请求编码为一行 JSON，客户端发送请求时使用
+ * @param request 待编码的请求
+ * @return 以换行结尾的帧
+ */
+std::string encode_frame(const RequestMessage& request) {
+    // 直接在序列化结果后追加换行，避免再拷贝一份帧
+    std::string frame = request.to_json().dump();
+    frame.push_back('\n');
+    return frame;
+}
+
+/**
+ * @brief 把回复编码为一行 JSON，服务器的回复、广播和分块都经过这里
+ * @param response 待编码的回复
+ * @return 以换行结尾的帧
+ */
+std::string encode_frame(const ResponseMessage& response) {
+    std::string frame = response.to_json().dump();
+    frame.push_back('\n');
+    return frame;
+}
+
+/**
+ * @brief 把大帧的下一段编码为分块帧，每段不超过 kChunkSize 字节
+ * @param id 分块传输编号
+ * @param index 分块序号
+ * @param content 完整帧，不含结尾换行
+ * @param offset 本段在帧中的起始位置，返回时更新为下一段的起始位置，等于帧长度时本段为最后一块
+ * @return 以换行结尾的分块帧
+ */
+std::string encode_chunk(std::uint32_t id, std::uint32_t index, std::string_view content, std::size_t& offset) {
+    std::size_t end = std::min(content.size(), offset + kChunkSize);
+    // 不能把一个 UTF-8 字符拆到两个分块中，否则分块无法编码为 JSON 字符串
+    while (end < content.size() && end > offset + 1 && (static_cast<unsigned char>(content[end]) & 0xC0) == 0x80) {
+        --end;
+    }
+    bool last = end == content.size();
+    ResponseMessage chunk = {"chunk", "success",
+                             {{"id", id}, {"index", index}, {"last", last},
+                              {"data", content.substr(offset, end - offset)}}};
+    offset = end;
+    return encode_frame(chunk);
+}
+
+/*
+ * 只保留客户端追踪中服务器认可的字段，回复和广播会原样带上这些字段
+ * \param trace 请求中的追踪对象
+ * \return 只含 id、client 和 client_send_ns 的追踪，字段缺失或类型不对时返回 null 表示不追踪
+ */
+static json accepted_trace(const json& trace) {
+    if (!trace.is_object()) {
+        return nullptr;
+    }
+    auto id = trace.find("id");
+    auto client = trace.find("client");
+    auto send_ns = trace.find("client_send_ns");
+    if (id == trace.end() || !id->is_number_unsigned() || client == trace.end() || !client->is_string() ||
+        send_ns == trace.end() || !send_ns->is_number_integer()) {
+        return nullptr;
+    }
+    return {{"id", *id}, {"client", *client}, {"client_send_ns", *send_ns}};
+}
+
+static const char kBase64Digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*
+ * 把任意字节编码为 base64，移交状态中的读缓冲可能以不完整的 UTF-8 字符结尾，不能直接放进 JSON 字符串
+ * \param data 原始字节
+ * \return base64 文本
+ */
+static std::string base64_encode(std::string_view data) {
+    std::string encoded;
+    encoded.reserve((data.size() + 2) / 3 * 4);
+    std::size_t i = 0;
+    for (; i + 2 < data.size(); i += 3) {
+        std::uint32_t group = (static_cast<unsigned char>(data[i]) << 16) |
+                              (static_cast<unsigned char>(data[i + 1]) << 8) | static_cast<unsigned char>(data[i + 2]);
+        encoded += kBase64Digits[(group >> 18) & 0x3F];
+        encoded += kBase64Digits[(group >> 12) & 0x3F];
+        encoded += kBase64Digits[(group >> 6) & 0x3F];
+        encoded += kBase64Digits[group & 0x3F];
+    }
+    if (i < data.size()) {
+        std::uint32_t group = static_cast<unsigned char>(data[i]) << 16;
+        if (i + 1 < data.size()) group |= static_cast<unsigned char>(data[i + 1]) << 8;
+        encoded += kBase64Digits[(group >> 18) & 0x3F];
+        encoded += kBase64Digits[(group >> 12) & 0x3F];
+        encoded += i + 1 < data.size() ? kBase64Digits[(group >> 6) & 0x3F] : '=';
+        encoded += '=';
+    }
+    return encoded;
+}
+
+/*
+ * 解码 base64 文本，遇到非法字符或填充时停止
+ * \param text base64 文本
+ * \return 原始字节
+ */
+static std::string base64_decode(std::string_view text) {
+    std::string decoded;
+    decoded.reserve(text.size() / 4 * 3);
+    std::uint32_t group = 0;
+    int bits = 0;
+    for (char c : text) {
+        const char* digit = c != '\0' ? std::strchr(kBase64Digits, c) : nullptr;
+        if (!digit) break;
+        group = (group << 6) | static_cast<std::uint32_t>(digit - kBase64Digits);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            decoded += static_cast<char>((group >> bits) & 0xFF);
+        }
+    }
+    return decoded;
+}
+
+/**
+ * @brief 一次连接的竞争状态，由解析、各地址连接尝试和定时器的回调共享
+ */
+struct ConnectRace {
+    explicit ConnectRace(boost::asio::io_context& io_context)
+            : resolver(io_context), stagger_timer(io_context), deadline_timer(io_context) {}
+
+    tcp::resolver resolver;                   ///< 域名解析器
+    boost::asio::steady_timer stagger_timer;  ///< 错开启动下一个地址的定时器
+    boost::asio::steady_timer deadline_timer; ///< 解析或连接阶段的超时定时器
+    std::vector<tcp::endpoint> endpoints;     ///< 按协议族交替排列的候选地址
+    std::size_t next = 0;                     ///< 下一个待尝试的地址
+    std::size_t pending = 0;                  ///< 正在进行的连接尝试数
+    std::vector<std::shared_ptr<tcp::socket>> attempts; ///< 所有已启动的连接尝试
+    error_code last_error = boost::asio::error::host_not_found; ///< 最近一次失败的原因
+    bool finished = false;                    ///< 是否已经产生结果，之后到达的回调直接忽略
+    std::function<void(const error_code&, std::shared_ptr<tcp::socket>)> done; ///< 完成回调
+};
+
+/*
+ * 按协议族交替排列解析结果，首个协议族沿用系统解析器给出的优先顺序（RFC 8305）
+ * \param results 解析结果
+ * \return 交替排列的地址
+ */
+static std::vector<tcp::endpoint> interleave_families(const tcp::resolver::results_type& results) {
+    std::deque<tcp::endpoint> preferred, others;
+    bool preferred_v6 = !results.empty() && results.begin()->endpoint().address().is_v6();
+    for (const auto& entry : results) {
+        (entry.endpoint().address().is_v6() == preferred_v6 ? preferred : others).push_back(entry.endpoint());
+    }
+    std::vector<tcp::endpoint> ordered;
+    while (!preferred.empty() || !others.empty()) {
+        if (!preferred.empty()) {
+            ordered.push_back(preferred.front());
+            preferred.pop_front();
+        }
+        if (!others.empty()) {
+            ordered.push_back(others.front());
+            others.pop_front();
+        }
+    }
+    return ordered;
+}
+
 ClientNetwork::ClientNetwork(std::string  server, std::string  port, std::string  username)
-        : socket_(io_context_), server_(std::move(server)), port_(std::move(port)), username_(std::move(username)){
+        : socket_(io_context_), server_(std::move(server)), port_(std::move(port)), username_(std::move(username)),
+          trace_report_timer_(io_context_), reconnect_timer_(io_context_), history_retry_timer_(io_context_){
 }
 
 ClientNetwork::~ClientNetwork() {
+    if (trace_sample_rate_ > 0) {
+        std::cout << "[Trace] " << trace_report().dump() << std::endl;
+    }
     socket_.close();
 }
 
@@ -62,41 +249,455 @@ void ClientNetwork::start_io_context() {
     io_context_.run();
 }
 
-bool ClientNetwork::connect_to_server() {
-    boost::asio::ip::tcp::resolver resolver(io_context_);
-    boost::system::error_code ec;
-    auto endpoints = resolver.resolve(server_, port_, ec);
-    if (!ec) {
-        boost::asio::connect(socket_, endpoints, ec);
+void ClientNetwork::set_connect_options(const ConnectOptions& options) {
+    connect_options_ = options;
+}
+
+void ClientNetwork::async_connect() {
+    start_connect([this](const error_code& ec, std::shared_ptr<tcp::socket> socket) {
+        if (ec) {
+            std::cerr << "[Client] Failed to connect: " << ec.message() << std::endl;
+            if (connection_callback_) connection_callback_(ConnectionEvent::failed, ec.message());
+            return;
+        }
+        adopt_socket(std::move(socket));
+        connected_ = true;
+        start_receiving();
+        if (connection_callback_) connection_callback_(ConnectionEvent::connected, server_ + ":" + port_);
+    });
+}
+
+/**
+ * @brief 解析服务器地址并按 Happy Eyeballs 方式竞争连接
+ *
+ * 超时后取消解析并以 timed_out 结束，之后到达的解析结果被忽略。
+ * @param done 完成回调，成功时携带胜出的socket
+ */
+void ClientNetwork::start_connect(std::function<void(const error_code&, std::shared_ptr<tcp::socket>)> done) {
+    auto race = std::make_shared<ConnectRace>(io_context_);
+    race->done = std::move(done);
+
+    race->deadline_timer.expires_after(connect_options_.resolve_timeout);
+    race->deadline_timer.async_wait([this, race](error_code ec) {
+        if (!ec) finish_connect(race, boost::asio::error::timed_out);
+    });
+    race->resolver.async_resolve(server_, port_, [this, race](error_code ec, tcp::resolver::results_type results) {
+        if (race->finished) return;
+        if (ec) {
+            finish_connect(race, ec);
+            return;
+        }
+        race->endpoints = interleave_families(results);
+        race->deadline_timer.expires_after(connect_options_.connect_timeout);
+        race->deadline_timer.async_wait([this, race](error_code ec) {
+            if (!ec) finish_connect(race, boost::asio::error::timed_out);
+        });
+        try_next_endpoint(race);
+    });
+}
+
+/**
+ * @brief 启动下一个地址的连接尝试，并在错开时间后继续启动后面的地址
+ * @param race 本次连接的竞争状态
+ */
+void ClientNetwork::try_next_endpoint(const std::shared_ptr<ConnectRace>& race) {
+    if (race->finished) return;
+    if (race->next >= race->endpoints.size()) {
+        // 所有地址都已尝试，最后一个尝试失败时结束
+        if (race->pending == 0) finish_connect(race, race->last_error);
+        return;
+    }
+
+    auto socket = std::make_shared<tcp::socket>(io_context_);
+    tcp::endpoint endpoint = race->endpoints[race->next++];
+    race->attempts.push_back(socket);
+    ++race->pending;
+    std::cout << "[Client] Connecting to " << endpoint << std::endl;
+    socket->async_connect(endpoint, [this, race, socket](error_code ec) {
+        --race->pending;
+        if (race->finished) return;
         if (!ec) {
-            // 连接成功后发送用户名
-            RequestMessage request = {"connect", username_, "", ""};
-            boost::asio::write(socket_, boost::asio::buffer(request.to_json().dump() + "\n"));
-            return true;
+            finish_connect(race, ec, socket);
+            return;
         }
+        race->last_error = ec;
+        // 失败时不必等待错开时间，立即尝试下一个地址
+        try_next_endpoint(race);
+    });
+
+    if (race->next < race->endpoints.size()) {
+        // 重新设置定时器会取消之前的等待
+        race->stagger_timer.expires_after(connect_options_.attempt_delay);
+        race->stagger_timer.async_wait([this, race](error_code ec) {
+            if (!ec) try_next_endpoint(race);
+        });
     }
-    return false;
+}
+
+/**
+ * @brief 结束连接竞争，关闭未胜出的尝试并调用完成回调
+ * @param race 本次连接的竞争状态
+ * @param ec 结果错误码
+ * @param winner 胜出的socket，失败时为空
+ */
+void ClientNetwork::finish_connect(const std::shared_ptr<ConnectRace>& race, const error_code& ec,
+                                   std::shared_ptr<tcp::socket> winner) {
+    if (race->finished) return;
+    race->finished = true;
+    // 解析超时时后台解析可能仍在进行，取消后其回调以 operation_aborted 返回
+    race->resolver.cancel();
+    race->stagger_timer.cancel();
+    race->deadline_timer.cancel();
+    for (const auto& attempt : race->attempts) {
+        if (attempt != winner) {
+            error_code ignored;
+            attempt->close(ignored);
+        }
+    }
+    race->attempts.clear();
+    race->done(ec, std::move(winner));
+}
+
+/**
+ * @brief 采用胜出的socket，发送用户名并清理上一个连接遗留的读状态
+ * @param socket 胜出的socket
+ */
+void ClientNetwork::adopt_socket(std::shared_ptr<tcp::socket> socket) {
+    error_code ignored;
+    socket_.close(ignored);
+    socket_ = std::move(*socket);
+    // 旧连接上未写完的帧不再发送
+    ++socket_generation_;
+    write_queue_.clear();
+    writing_ = false;
+    read_buffer_.clear();
+    pending_chunks_.clear();
+
+    // 连接成功后发送用户名
+    RequestMessage request = {"connect", username_, "", ""};
+    write_request(request);
+}
+
+/**
+ * @brief 已建立的连接断开，通知上层并按退避时间安排重连
+ * @param ec 断开原因
+ */
+void ClientNetwork::handle_disconnect(const error_code& ec) {
+    error_code ignored;
+    socket_.close(ignored);
+    // 断开期间的请求直接丢弃，重连后重新订阅频道
+    ++socket_generation_;
+    write_queue_.clear();
+    writing_ = false;
+    if (connection_callback_) connection_callback_(ConnectionEvent::disconnected, ec.message());
+    if (connected_ && connect_options_.auto_reconnect) {
+        reconnect_delay_ = connect_options_.reconnect_initial;
+        schedule_reconnect();
+    }
+}
+
+/**
+ * @brief 按指数退避加随机抖动等待后重连，成功后重新订阅之前的所有频道
+ */
+void ClientNetwork::schedule_reconnect() {
+    // 在 [delay/2, delay] 中随机等待，避免服务器重启后所有客户端同时重连
+    auto delay_ms = reconnect_delay_.count();
+    std::chrono::milliseconds wait(
+            std::uniform_int_distribution<long long>(delay_ms / 2, delay_ms)(reconnect_rng_));
+    std::cout << "[Client] Reconnecting in " << wait.count() << " ms" << std::endl;
+
+    reconnect_timer_.expires_after(wait);
+    reconnect_timer_.async_wait([this](error_code ec) {
+        if (ec) return;
+        start_connect([this](const error_code& ec, std::shared_ptr<tcp::socket> socket) {
+            if (ec) {
+                std::cerr << "[Client] Reconnect failed: " << ec.message() << std::endl;
+                reconnect_delay_ = std::min(reconnect_delay_ * 2, connect_options_.reconnect_max);
+                schedule_reconnect();
+                return;
+            }
+            adopt_socket(std::move(socket));
+            start_receiving();
+
+            std::string channel;
+            std::vector<std::string> channels;
+            {
+                std::lock_guard<std::mutex> lock(history_mutex_);
+                channel = channel_;
+                for (const auto& [name, subscription] : subscriptions_) {
+                    channels.push_back(name);
+                }
+            }
+            for (const auto& name : channels) {
+                // 重新订阅频道并补齐断开期间的消息
+                subscribe_channel(name);
+            }
+            if (connection_callback_) connection_callback_(ConnectionEvent::reconnected, channel);
+        });
+    });
 }
 
 void ClientNetwork::get_channel_list() {
     // 发送获取频道列表的请求
     RequestMessage request = {"get_channel_list", username_, "", ""};
-    boost::asio::write(socket_, boost::asio::buffer(request.to_json().dump() + "\n"));
+    write_request(request);
 
 }
 
 void ClientNetwork::join_channel(const std::string& channel) {
-    // 发送加入频道请求
-    RequestMessage request = {"join_channel", username_, channel, ""};
-    channel_=channel;
-    boost::asio::write(socket_, boost::asio::buffer(request.to_json().dump() + "\n"));
+    if (!is_subscribed(channel)) {
+        subscribe_channel(channel);
+    }
+    set_active_channel(channel);
+}
+
+void ClientNetwork::subscribe_channel(const std::string& channel) {
+    // 发送订阅频道请求
+    RequestMessage request = {"subscribe", username_, channel, ""};
+    RequestMessage history_request = {"get_history", username_, channel, ""};
+    {
+        // 历史回复到达前收到的实时消息先暂存，保证显示顺序
+        std::lock_guard<std::mutex> lock(history_mutex_);
+        std::uint64_t cached_seq = history_cache_ ? history_cache_->last_seq(cache_key(), server_epoch_, channel) : 0;
+        ChannelSubscription& subscription = subscriptions_[channel];
+        // 重新订阅同一频道（例如重连后）时只请求尚未显示的消息
+        subscription.displayed_seq = std::max(subscription.displayed_seq, cached_seq);
+        subscription.history_pending = true;
+        subscription.held_messages.clear();
+        subscription.requested_seq = subscription.displayed_seq;
+        subscription.requested_at = std::chrono::steady_clock::now();
+        history_request.after_seq = subscription.displayed_seq;
+    }
+    write_request(request);
+    // 只请求本地缓存之后的新消息
+    write_request(history_request);
+    boost::asio::post(io_context_, [this]() { schedule_history_retry(); });
+}
+
+void ClientNetwork::unsubscribe_channel(const std::string& channel) {
+    RequestMessage request = {"unsubscribe", username_, channel, ""};
+    {
+        std::lock_guard<std::mutex> lock(history_mutex_);
+        subscriptions_.erase(channel);
+        if (channel_ == channel) {
+            channel_.clear();
+        }
+    }
+    write_request(request);
+}
+
+void ClientNetwork::set_active_channel(const std::string& channel) {
+    std::lock_guard<std::mutex> lock(history_mutex_);
+    channel_ = channel;
+}
 
+bool ClientNetwork::is_subscribed(const std::string& channel) {
+    std::lock_guard<std::mutex> lock(history_mutex_);
+    return subscriptions_.count(channel) != 0;
 }
 
 void ClientNetwork::send_message(const std::string& message) {
     // 发送消息
     RequestMessage request = {"send_message", username_, channel_, message};
-    boost::asio::write(socket_, boost::asio::buffer(request.to_json().dump() + "\n"));
+    write_request(request);
+}
+
+void ClientNetwork::search(const std::string& query, std::uint32_t page) {
+    // 发送搜索请求
+    RequestMessage request = {"search", username_, channel_, query, page};
+    write_request(request);
+}
+
+bool ClientNetwork::enable_history_cache(const std::string& db_path) {
+    try {
+        history_cache_ = std::make_unique<HistoryCache>(db_path);
+        // 先沿用上次得知的纪元，收到历史回复后再校验
+        std::lock_guard<std::mutex> lock(history_mutex_);
+        server_epoch_ = history_cache_->epoch(cache_key());
+        return true;
+    } catch (const std::exception& e) {
+        std::cerr << "[Cache] " << e.what() << std::endl;
+        return false;
+    }
+}
+
+std::vector<std::string> ClientNetwork::cached_messages(const std::string& channel) {
+    static constexpr std::size_t cached_limit = 200;
+    std::vector<std::string> lines;
+    if (!history_cache_) return lines;
+    std::string epoch;
+    {
+        std::lock_guard<std::mutex> lock(history_mutex_);
+        epoch = server_epoch_;
+    }
+    for (const auto& record : history_cache_->load_recent(cache_key(), epoch, channel, cached_limit)) {
+        lines.push_back(record.sender + ": " + record.content);
+    }
+    return lines;
+}
+
+/**
+ * @brief 按采样率为请求附加追踪时间戳，然后发送
+ * @param request 待发送的请求
+ */
+void ClientNetwork::write_request(RequestMessage& request) {
+    if (trace_sample_rate_ > 0) {
+        std::lock_guard<std::mutex> lock(trace_mutex_);
+        if (std::uniform_real_distribution<double>(0.0, 1.0)(trace_rng_) < trace_sample_rate_) {
+            request.trace = {{"id", next_trace_id_++}, {"client", username_}};
+        }
+    }
+    // 写操作只在 I/O 线程中进行，GUI 线程发送请求时不会被网络阻塞
+    boost::asio::post(io_context_, [this, request]() mutable {
+        // 发送时间尽量靠近真正的写操作
+        if (request.trace.is_object()) {
+            std::int64_t send_ns = monotonic_now_ns();
+            request.trace["client_send_ns"] = send_ns;
+            std::lock_guard<std::mutex> lock(trace_mutex_);
+            pending_traces_[request.trace["id"].get<std::uint64_t>()] = send_ns;
+            // 断开期间丢失的请求永远收不到回复，只保留最近的若干个
+            while (pending_traces_.size() > kMaxPendingTraces) {
+                pending_traces_.erase(pending_traces_.begin());
+            }
+        }
+        write_queue_.push_back(std::make_shared<const std::string>(encode_frame(request)));
+        pump_writes();
+    });
+}
+
+/**
+ * @brief 从写队列中取出下一帧异步发送，写完成后继续发送下一帧
+ */
+void ClientNetwork::pump_writes() {
+    if (writing_ || write_queue_.empty()) return;
+
+    auto frame = std::move(write_queue_.front());
+    write_queue_.pop_front();
+    writing_ = true;
+    boost::asio::async_write(socket_, boost::asio::buffer(*frame),
+                             [this, frame, generation = socket_generation_](const error_code& ec, std::size_t) {
+        // socket 已被替换或关闭，队列已经清空
+        if (generation != socket_generation_) return;
+        writing_ = false;
+        if (ec) {
+            // 断开由读操作发现并处理，这里只丢弃剩余的请求
+            std::cerr << "[Client] Failed to send request: " << ec.message() << std::endl;
+            write_queue_.clear();
+            return;
+        }
+        pump_writes();
+    });
+}
+
+void ClientNetwork::set_trace_sample_rate(double rate) {
+    trace_sample_rate_ = std::clamp(rate, 0.0, 1.0);
+    if (trace_sample_rate_ > 0) {
+        // 定时器只能在 I/O 线程中操作
+        boost::asio::post(io_context_, [this]() { schedule_trace_report(); });
+    }
+}
+
+/**
+ * @brief 启动历史请求的重发定时器，等待超时的频道按原 after_seq 重新请求
+ */
+void ClientNetwork::schedule_history_retry() {
+    if (history_retry_scheduled_) return;
+    history_retry_scheduled_ = true;
+    history_retry_timer_.expires_after(kHistoryRetryInterval);
+    history_retry_timer_.async_wait([this](error_code ec) {
+        history_retry_scheduled_ = false;
+        if (ec) return;
+
+        std::vector<RequestMessage> requests;
+        bool pending = false;
+        {
+            std::lock_guard<std::mutex> lock(history_mutex_);
+            auto now = std::chrono::steady_clock::now();
+            for (auto& [name, subscription] : subscriptions_) {
+                if (!subscription.history_pending) continue;
+                pending = true;
+                if (now - subscription.requested_at < kHistoryRetryInterval) continue;
+                // after_seq 不变，先到的回复生效，之后重复的回复被忽略
+                subscription.requested_at = now;
+                RequestMessage request = {"get_history", username_, name, ""};
+                request.after_seq = subscription.requested_seq;
+                requests.push_back(std::move(request));
+            }
+        }
+        for (auto& request : requests) {
+            std::cerr << "[Client] History for " << request.channel << " timed out, requesting again" << std::endl;
+            write_request(request);
+        }
+        if (pending) {
+            schedule_history_retry();
+        }
+    });
+}
+
+/**
+ * @brief 定期打印客户端的延迟追踪直方图，没有采样时不输出
+ */
+void ClientNetwork::schedule_trace_report() {
+    trace_report_timer_.expires_after(kTraceReportInterval);
+    trace_report_timer_.async_wait([this](error_code ec) {
+        if (ec) return;
+        json report = trace_report();
+        if (!report.empty()) {
+            std::cout << "[Trace] " << report.dump() << std::endl;
+        }
+        schedule_trace_report();
+    });
+}
+
+json ClientNetwork::trace_report() {
+    std::lock_guard<std::mutex> lock(trace_mutex_);
+    json report = json::object();
+    for (const auto& [stage, histogram] : trace_histograms_) {
+        report[stage] = histogram.to_json();
+    }
+    return report;
+}
+
+/**
+ * @brief 记录一条本客户端发起的追踪回复的网络和服务器耗时
+ *
+ * 按追踪编号匹配本客户端发出且尚未收到回复的请求，发送时间取自本地记录，
+ * 每个请求只统计第一次收到的回复。
+ * 客户端和服务器的单调时钟不可比较，只对同一时钟的时间戳相减：
+ * 往返时间减去服务器停留时间即为双向网络及收发开销，单程按其一半估算。
+ * @param trace 回复中携带的追踪时间戳
+ * @return 是本客户端尚未收到回复的采样请求时返回 true
+ */
+bool ClientNetwork::record_trace(const json& trace) {
+    if (trace.value("client", "") != username_ || !trace.contains("id") || !trace["id"].is_number_unsigned() ||
+        !trace.contains("server_recv_ns") || !trace.contains("server_send_ns")) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(trace_mutex_);
+    auto pending_it = pending_traces_.find(trace["id"].get<std::uint64_t>());
+    if (pending_it == pending_traces_.end()) {
+        return false;
+    }
+    std::int64_t rtt = received_ns_ - pending_it->second;
+    pending_traces_.erase(pending_it);
+    std::int64_t server_residency = trace["server_send_ns"].get<std::int64_t>() -
+                                    trace["server_recv_ns"].get<std::int64_t>();
+
+    trace_histograms_["rtt"].record(rtt);
+    trace_histograms_["server_residency"].record(server_residency);
+    trace_histograms_["network_round_trip"].record(rtt - server_residency);
+    trace_histograms_["network_one_way_estimate"].record((rtt - server_residency) / 2);
+    return true;
+}
+
+/**
+ * @brief 记录采样回复从读取完成到界面显示完成的耗时
+ * @param received_ns 回复读取完成的单调时间
+ */
+void ClientNetwork::record_render(std::int64_t received_ns) {
+    std::int64_t rendered_ns = monotonic_now_ns();
+    std::lock_guard<std::mutex> lock(trace_mutex_);
+    trace_histograms_["client_render"].record(rendered_ns - received_ns);
 }
 
 /**
@@ -104,22 +705,23 @@ void ClientNetwork::send_message(const std::string& message) {
  * 这个函数使用 boost::asio::async_read_until 来不断读取服务器发来的消息直到遇到换行符。
  */
 void ClientNetwork::start_receiving() {
-    auto buffer = std::make_shared<std::string>();
-    boost::asio::async_read_until(socket_, boost::asio::dynamic_buffer(*buffer), "\n",
-                                  [this, buffer](const boost::system::error_code& ec, std::size_t length) {
+    boost::asio::async_read_until(socket_, boost::asio::dynamic_buffer(read_buffer_), "\n",
+                                  [this](const boost::system::error_code& ec, std::size_t length) {
           if (!ec && length > 0) {
-              std::string data(buffer->substr(0, length));
-              buffer->erase(0, length);  // 清除已读取的数据
+              // 缓冲中换行之后的字节属于下一帧，保留到下次读取
+              received_ns_ = monotonic_now_ns();
+              std::string data(read_buffer_.substr(0, length));
+              read_buffer_.erase(0, length);  // 清除已读取的数据
 
               auto response = ResponseMessage::from_json(json::parse(data));
               handle_server_message(response);
               // 继续监听更多消息
               this->start_receiving();
+          } else if (ec == boost::asio::error::operation_aborted) {
+              // socket 被主动关闭或已被新连接替换
           } else {
               std::cerr << "Error receiving: " << ec.message() << std::endl;
-              if (ec != boost::asio::error::eof) {
-                  this->start_receiving();
-              }
+              handle_disconnect(ec);
           }
         }
     );
@@ -134,28 +736,214 @@ void ClientNetwork::handle_server_message(const ResponseMessage& response) {
     std::cout << "[Client] Parsed message:" << std::endl;
     std::cout << "  Type: " << response.type << std::endl;
     std::cout << "  Status " << response.status << std::endl;
-    if (response.type == "send_message" && message_callback_) {
+    if (response.type == "chunk") {
+        handle_chunk(response.content);
+    } else if (response.type == "send_message" && message_callback_) {
         std::cout << "[Client] Handling send_message." << std::endl;
 
         // 检查 content 是否是对象，并提取其中的字段
         if (response.content.is_object()) {
-            auto content = response.content;
-
-            // 提取 sender、channel 和 message 内容
-            std::string sender = content["sender"];
-            std::string channel = content["channel"];
-            std::string message = content["content"];
-
-            std::string full_message =sender + ": " + message;
-            std::cout<<full_message<<std::endl;
-            message_callback_(full_message);  // 调用回调函数，显示消息
+            {
+                std::lock_guard<std::mutex> lock(history_mutex_);
+                auto it = subscriptions_.find(response.content.value("channel", ""));
+                if (it != subscriptions_.end() && it->second.history_pending && response.content.contains("seq")) {
+                    // 该频道的历史回复尚未到达，暂存以免新消息显示在历史之前
+                    it->second.held_messages.push_back(response.content);
+                    return;
+                }
+            }
+            show_live_message(response.content);
         }
+    } else if (response.type == "history") {
+        std::cout << "[Client] Handling history." << std::endl;
+        handle_history(response);
     } else if (response.type == "channel_list" && channel_list_callback_) {
         std::cout << "[Client] Handling channel_list." << std::endl;
         if (response.content.is_array()) {
             std::vector<std::string> channels = response.content.get<std::vector<std::string>>();
             channel_list_callback_(channels);
         }
+    } else if (response.type == "search_result" && search_result_callback_) {
+        std::cout << "[Client] Handling search_result." << std::endl;
+        if (response.content.is_object()) {
+            search_result_callback_(response.content);
+        }
+    }
+    // 任何类型的回复只要带有本客户端发出的追踪编号都计入统计，回调已在上面完成
+    if (response.trace.is_object() && record_trace(response.trace)) {
+        if (render_callback_) {
+            // 界面在 GUI 线程显示完上面提交的更新后再统计渲染耗时
+            render_callback_(received_ns_);
+        } else {
+            record_render(received_ns_);
+        }
+    }
+}
+
+/**
+ * @brief 拼接服务器分块发送的大消息，收到最后一块后按普通消息处理
+ * @param chunk 分块内容，包含 id、index、last 和 data
+ */
+void ClientNetwork::handle_chunk(const json& chunk) {
+    auto id = chunk.at("id").get<std::uint32_t>();
+    std::string& frame = pending_chunks_[id];
+    frame += chunk.at("data").get<std::string>();
+    if (chunk.at("last").get<bool>()) {
+        auto response = ResponseMessage::from_json(json::parse(frame));
+        pending_chunks_.erase(id);
+        handle_server_message(response);
+    }
+}
+
+/**
+ * @brief 显示一条实时消息，跳过已显示的序号，并写入缓存
+ * @param content 消息内容，包含 sender、channel、content 和可选的 seq
+ * @return 是否显示了消息
+ */
+bool ClientNetwork::show_live_message(const json& content) {
+    // 提取 sender、channel 和 message 内容
+    std::string sender = content["sender"];
+    std::string channel = content["channel"];
+    std::string message = content["content"];
+
+    HistoryRecord record;
+    std::string epoch;
+    {
+        std::lock_guard<std::mutex> lock(history_mutex_);
+        epoch = server_epoch_;
+        auto it = subscriptions_.find(channel);
+        if (it == subscriptions_.end()) {
+            // 已经退订，丢弃退订前已在路上的消息
+            return false;
+        }
+        if (content.contains("seq")) {
+            record.seq = content["seq"].get<std::uint64_t>();
+            if (record.seq <= it->second.displayed_seq) {
+                // 已经通过历史回复显示过
+                return false;
+            }
+            it->second.displayed_seq = record.seq;
+        }
+    }
+
+    if (record.seq != 0 && history_cache_) {
+        // 广播不携带服务器时间，使用本地接收时间
+        record.channel = channel;
+        record.sender = sender;
+        record.content = message;
+        record.timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+        history_cache_->store(cache_key(), epoch, {record});
+    }
+
+    std::string full_message =sender + ": " + message;
+    std::cout<<full_message<<std::endl;
+    if (message_callback_) {
+        message_callback_(channel, full_message);  // 调用回调函数，在消息所属频道中显示
+    }
+    return true;
+}
+
+/**
+ * @brief 处理服务器返回的增量历史，写入缓存并显示，然后显示等待期间收到的实时消息
+ *
+ * 回复中的纪元与缓存的不同时，丢弃旧纪元的缓存，按旧序号显示或请求过的频道从头重新请求。
+ * @param response 历史回复，content 包含 channel、after_seq、epoch、truncated 和 messages
+ */
+void ClientNetwork::handle_history(const ResponseMessage& response) {
+    std::vector<HistoryRecord> records;
+    std::vector<json> held;
+    bool truncated = false;
+    std::string channel;
+    std::string epoch;
+    std::vector<std::string> reset_channels;
+    {
+        std::lock_guard<std::mutex> lock(history_mutex_);
+        if (!response.content.is_object() || !response.content.contains("channel")) {
+            // 服务器未开启历史时的错误回复不带频道，结束所有频道的等待
+            for (auto& [name, subscription] : subscriptions_) {
+                if (!subscription.history_pending) continue;
+                subscription.history_pending = false;
+                held.insert(held.end(), subscription.held_messages.begin(), subscription.held_messages.end());
+                subscription.held_messages.clear();
+            }
+        } else {
+            channel = response.content.at("channel").get<std::string>();
+            auto it = subscriptions_.find(channel);
+            if (it == subscriptions_.end()) {
+                // 已经退订该频道，丢弃回复
+                return;
+            }
+            ChannelSubscription& subscription = it->second;
+            if (!subscription.history_pending ||
+                response.content.value("after_seq", std::uint64_t(0)) != subscription.requested_seq) {
+                // 纪元改变前发出的过期请求的回复
+                return;
+            }
+            std::string reply_epoch = response.content.value("epoch", "");
+            if (response.status == "success" && !reply_epoch.empty() && reply_epoch != server_epoch_) {
+                server_epoch_ = reply_epoch;
+                if (history_cache_) {
+                    history_cache_->set_epoch(cache_key(), server_epoch_);
+                }
+                // 服务器换了新的历史，按旧序号显示或请求的频道都要从头重新请求
+                for (auto& [name, other] : subscriptions_) {
+                    if (other.displayed_seq == 0 && other.requested_seq == 0) continue;
+                    other.displayed_seq = 0;
+                    other.requested_seq = 0;
+                    other.requested_at = std::chrono::steady_clock::now();
+                    other.history_pending = true;
+                    reset_channels.push_back(name);
+                }
+            }
+            epoch = server_epoch_;
+            bool reset = std::find(reset_channels.begin(), reset_channels.end(), channel) != reset_channels.end();
+            if (reset) {
+                // 等待重新请求的回复，暂存的实时消息继续保留
+            } else if (response.status == "success") {
+                truncated = response.content.value("truncated", false);
+                for (const auto& item : response.content.at("messages")) {
+                    HistoryRecord record;
+                    record.seq = item.at("seq").get<std::uint64_t>();
+                    if (record.seq <= subscription.displayed_seq) continue;
+                    record.channel = channel;
+                    record.sender = item.at("sender").get<std::string>();
+                    record.content = item.at("content").get<std::string>();
+                    record.timestamp = item.at("timestamp").get<std::int64_t>();
+                    subscription.displayed_seq = record.seq;
+                    records.push_back(std::move(record));
+                }
+            }
+            if (!reset) {
+                subscription.history_pending = false;
+                held.swap(subscription.held_messages);
+            }
+        }
+    }
+
+    for (const auto& name : reset_channels) {
+        if (message_callback_) {
+            message_callback_(name, "[server history was reset]");
+        }
+        RequestMessage history_request = {"get_history", username_, name, ""};
+        write_request(history_request);
+    }
+    if (!reset_channels.empty()) {
+        schedule_history_retry();
+    }
+    if (history_cache_) {
+        history_cache_->store(cache_key(), epoch, records);
+    }
+    if (message_callback_) {
+        if (truncated) {
+            message_callback_(channel, "...");
+        }
+        for (const auto& record : records) {
+            message_callback_(channel, record.sender + ": " + record.content);
+        }
+    }
+    for (const auto& content : held) {
+        show_live_message(content);
     }
 }
 
@@ -167,20 +955,140 @@ void ClientNetwork::setChannelListCallback(ChannelListCallback callback) {
     channel_list_callback_ = callback;
 }
 
+void ClientNetwork::setSearchResultCallback(SearchResultCallback callback) {
+    search_result_callback_ = callback;
+}
+
+void ClientNetwork::setConnectionCallback(ConnectionCallback callback) {
+    connection_callback_ = callback;
+}
+
+void ClientNetwork::setRenderCallback(RenderCallback callback) {
+    render_callback_ = callback;
+}
+
 /**
  * @brief 构造函数，初始化服务器和频道
  * @param port 服务器端口
  * @param channels 服务器上可用的频道
  */
 ServerNetwork::ServerNetwork(short port, const std::vector<std::string>& channels)
-:acceptor_(io_context_, tcp::endpoint(tcp::v4(), port))
+:acceptor_(io_context_), capture_flush_timer_(io_context_), drain_timer_(io_context_),
+ trace_report_timer_(io_context_)
 {
+    listen_dual_stack(static_cast<unsigned short>(port));
     this->channels_=channels;
-    // 初始化每个频道，将频道名作为键，空的std::vector作为值
+    // 在路由表中登记每个频道，初始没有订阅者
     for (const std::string& channel : channels) {
-        // 在 channel_members_ 中为每个频道初始化一个空的 vector
-        this->channel_members_[channel] = std::vector<std::string>();
+        this->router_.add_channel(channel);
+    }
+}
+
+/**
+ * @brief 构造函数，从旧进程接管监听socket、客户端socket和频道状态
+ * @param upgrade_path 旧进程的升级控制 Unix 域套接字路径
+ */
+ServerNetwork::ServerNetwork(const std::string& upgrade_path)
+:acceptor_(io_context_), capture_flush_timer_(io_context_), drain_timer_(io_context_),
+ trace_report_timer_(io_context_)
+{
+#ifdef HACK_CHAT_HAS_UPGRADE_HANDOFF
+    boost::asio::local::stream_protocol::socket peer(io_context_);
+    peer.connect(boost::asio::local::stream_protocol::endpoint(upgrade_path));
+
+    std::string state_str;
+    std::vector<int> fds;
+    if (!receive_upgrade_handoff(peer.native_handle(), state_str, fds) || fds.empty()) {
+        throw std::runtime_error("failed to take over from " + upgrade_path);
+    }
+    json state = json::parse(state_str);
+
+    // 描述符的协议族与监听socket一致
+    tcp protocol = state.at("family").get<std::string>() == "v6" ? tcp::v6() : tcp::v4();
+    acceptor_.assign(protocol, fds[0]);
+
+    channels_ = state.at("channels").get<std::vector<std::string>>();
+    for (const std::string& channel : channels_) {
+        router_.add_channel(channel);
     }
+    for (const auto& [channel, members] : state.at("channel_members").items()) {
+        // 旧版本进程可能因订阅请求创建过频道列表之外的频道，不再保留
+        if (!has_channel(channel)) continue;
+        for (const auto& member : members) {
+            router_.subscribe(channel, member.get<std::string>());
+        }
+    }
+    next_session_id_ = state.at("next_session_id").get<std::uint32_t>();
+    // 分块传输编号延续旧进程，客户端不会把新传输拼接到旧的未完成分块上
+    next_transfer_id_ = state.value("next_transfer_id", next_transfer_id_);
+    const json batch_windows = state.value("batch_windows", json::object());
+    for (const auto& [channel, window_us] : batch_windows.items()) {
+        set_broadcast_window(channel, std::chrono::microseconds(window_us.get<std::int64_t>()));
+    }
+    // 旧版本进程不传数据库路径，它们总是使用默认路径；旧进程未开启历史时路径为空
+    std::string history_path = state.value("history_path", std::string("hack_chat_history.db"));
+    if (!history_path.empty()) {
+        enable_history(history_path);
+    }
+    if (state.contains("capture")) {
+        // 会话编号延续旧进程，抓包追加到同一文件后可以整体回放
+        const json& capture = state.at("capture");
+        capture_path_ = capture.at("path").get<std::string>();
+        capture_ = std::make_unique<TrafficCapture>(capture_path_, capture.at("start_ns").get<std::int64_t>());
+        std::cout << "[Capture] Continuing capture in " << capture_path_ << std::endl;
+        schedule_capture_flush();
+    }
+
+    const json& sessions = state.at("sessions");
+    for (std::size_t i = 0; i < sessions.size() && i + 1 < fds.size(); ++i) {
+        auto session = std::make_shared<ClientSession>();
+        session->id = sessions[i].at("id").get<std::uint32_t>();
+        session->socket = std::make_shared<tcp::socket>(io_context_);
+        session->socket->assign(protocol, fds[i + 1]);
+        if (sessions[i].contains("read_buffer_base64")) {
+            session->read_buffer = base64_decode(sessions[i].at("read_buffer_base64").get_ref<const std::string&>());
+        } else {
+            // 旧版本进程直接传递读缓冲文本
+            session->read_buffer = sessions[i].at("read_buffer").get_ref<const std::string&>();
+        }
+        sessions_[session->id] = session;
+
+        std::string username = sessions[i].at("username").get<std::string>();
+        if (!username.empty()) {
+            client_usernames_.insert({username, session});
+        }
+        // 继续处理旧进程未读完的请求
+        handle_client(session);
+    }
+    std::cout << "[Upgrade] Took over " << sessions_.size() << " sessions from " << upgrade_path << std::endl;
+#else
+    throw std::runtime_error("socket handoff is not supported on this platform: " + upgrade_path);
+#endif
+}
+
+/**
+ * @brief 打开监听socket，优先监听 IPv6 双栈地址，系统不支持时退回 IPv4
+ * @param port 服务器端口
+ */
+void ServerNetwork::listen_dual_stack(unsigned short port) {
+    tcp::endpoint endpoint(tcp::v6(), port);
+    error_code ec;
+    acceptor_.open(endpoint.protocol(), ec);
+    if (!ec) {
+        // 关闭 IPV6_V6ONLY，IPv4 客户端以映射地址接入同一个socket
+        acceptor_.set_option(boost::asio::ip::v6_only(false), ec);
+        if (ec) {
+            acceptor_.close();
+        }
+    }
+    if (ec) {
+        std::cerr << "[Server] IPv6 dual-stack unavailable (" << ec.message() << "), listening on IPv4 only" << std::endl;
+        endpoint = tcp::endpoint(tcp::v4(), port);
+        acceptor_.open(endpoint.protocol());
+    }
+    acceptor_.set_option(tcp::acceptor::reuse_address(true));
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
 }
 
 /**
@@ -188,6 +1096,7 @@ ServerNetwork::ServerNetwork(short port, const std::vector<std::string>& channel
  */
 void ServerNetwork::run_server() {
     accept_connection();
+    schedule_trace_report();
     io_context_.run();
 }
 
@@ -196,9 +1105,19 @@ void ServerNetwork::run_server() {
  */
 void ServerNetwork::accept_connection() {
     acceptor_.async_accept([this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+        if (upgrading_) {
+            // 监听socket已经交给新进程，新连接由新进程接受
+            return;
+        }
         if (!ec) {
-            auto socket_ptr = std::make_shared<tcp::socket>(std::move(socket));
-            handle_client(socket_ptr);
+            auto session = std::make_shared<ClientSession>();
+            session->id = next_session_id_++;
+            session->socket = std::make_shared<tcp::socket>(std::move(socket));
+            sessions_[session->id] = session;
+            if (capture_) {
+                capture_->record_open(session->id);
+            }
+            handle_client(session);
         }
         accept_connection();  // 继续接受新的连接
     });
@@ -206,120 +1125,836 @@ void ServerNetwork::accept_connection() {
 
 /**
  * @brief 处理客户端连接，读取并解析客户端的请求
- * @param socket 客户端的TCP socket
+ *
+ * 一次读取可能带来多行请求，整批在读缓冲中原地解析并分发，
+ * 解析出的请求从会话的分发缓冲区分配，整批处理完后一次性释放。
+ * @param session 客户端会话
  */
-void ServerNetwork::handle_client(std::shared_ptr<tcp::socket> socket_ptr) {
-    auto self = this;  // 为了在异步操作中保持类的生命周期
-    auto buffer = std::make_shared<std::string>();
-
-    boost::asio::async_read_until(*socket_ptr, boost::asio::dynamic_buffer(*buffer), "\n",
-                                  [this, self, socket_ptr,buffer](error_code ec, std::size_t length) {
+void ServerNetwork::handle_client(std::shared_ptr<ClientSession> session) {
+    session->reading = true;
+    boost::asio::async_read_until(*session->socket, boost::asio::dynamic_buffer(session->read_buffer), "\n",
+                                  [this, session](error_code ec, std::size_t) {
+        session->reading = false;
         if (!ec) {
-            std::string data(buffer->substr(0, length));
-            buffer->erase(0, length);  // 清除已读取的数据
+            std::int64_t received_ns = monotonic_now_ns();
+            const std::pmr::string& buffer = session->read_buffer;
+            std::size_t begin = 0;
+            std::size_t end;
+            while ((end = buffer.find('\n', begin)) != std::pmr::string::npos) {
+                std::string_view data(buffer.data() + begin, end + 1 - begin);
+                begin = end + 1;
+                if (capture_) {
+                    capture_->record_frame(session->id, data);
+                }
 
-            if (data.empty()) {
-                std::cerr << "[Error] Received empty input, skipping." << std::endl;
-                return;
-            }
+                if (data.size() == 1) {
+                    std::cerr << "[Error] Received empty input, skipping." << std::endl;
+                    continue;
+                }
+
+                // 使用 RequestMessage 结构体进行 JSON 反序列化
+                RequestMessage message = RequestMessage::from_json(json::parse(data.begin(), data.end()),
+                                                                   &session->dispatch_arena);
+
+                std::cout << "[Server] Parsed message:" << std::endl;
+                std::cout << "  Type: " << message.type << std::endl;
+                std::cout << "  Username: " << message.username << std::endl;
+                std::cout << "  Channel: " << message.channel << std::endl;
+                std::cout << "  Content: " << message.content << std::endl;
 
-            // 使用 RequestMessage 结构体进行 JSON 反序列化
-            RequestMessage message = RequestMessage::from_json(nlohmann::json::parse(data));
-
-            std::cout << "[Server] Parsed message:" << std::endl;
-            std::cout << "  Type: " << message.type << std::endl;
-            std::cout << "  Username: " << message.username << std::endl;
-            std::cout << "  Channel: " << message.channel << std::endl;
-            std::cout << "  Content: " << message.content << std::endl;
-
-            if (message.type == "connect") {
-                // 处理连接请求
-                client_usernames_.insert({message.username, socket_ptr});  // 将用户名与socket关联
-
-                // 发送确认消息
-                ResponseMessage response_message = {"connect", "success", "Username registered"};
-                boost::asio::async_write(*socket_ptr,
-                                         boost::asio::buffer(response_message.to_json().dump() + "\n"),
-                                         [](boost::system::error_code, std::size_t) {});
-
-            } else if (message.type == "get_channel_list") {
-                // 处理获取频道列表请求，使用 JSON 数组返回
-                nlohmann::json channel_list_json = channels_;
-
-                // 使用 ResponseMessage 构建频道列表响应
-                ResponseMessage response_message = {"channel_list", "success", channel_list_json};
-                boost::asio::async_write(*socket_ptr,
-                                         boost::asio::buffer(response_message.to_json().dump() + "\n"),
-                                         [](boost::system::error_code, std::size_t) {});
-
-            } else if (message.type == "join_channel") {
-                // 处理加入频道请求
-                std::string username = message.username;
-                std::string new_channel_name = message.channel;
-
-                // 检查用户是否已经在其他频道中
-                for (auto& [channel_name, members] : channel_members_) {
-                    auto it = std::find(members.begin(), members.end(), username);
-                    if (it != members.end()) {
-                        // 用户已经在这个频道，先移除用户
-                        members.erase(it);
-                        std::cout << "User " << username << " removed from channel " << channel_name << std::endl;
-                        break;  // 一个用户只能在一个频道，找到并移除后即可退出循环
-                    }
+                // 采样的请求附加服务器接收和分发时间，客户端字段只保留白名单中的几项
+                message.trace = accepted_trace(message.trace);
+                if (message.trace.is_object()) {
+                    std::int64_t dispatch_ns = monotonic_now_ns();
+                    message.trace["server_recv_ns"] = received_ns;
+                    message.trace["server_dispatch_ns"] = dispatch_ns;
+                    trace_histograms_["server_parse"].record(dispatch_ns - received_ns);
                 }
 
-                // 将用户加入到新的频道
-                channel_members_[new_channel_name].push_back(username);
-                std::cout << "User " << username << " joined channel " << new_channel_name << std::endl;
-
-                // 发送确认消息
-                // 发送加入频道确认消息，使用 ResponseMessage 结构体
-                ResponseMessage response_message = {"join_channel", "success", "Joined " + new_channel_name};
-                boost::asio::async_write(*socket_ptr,
-                                         boost::asio::buffer(response_message.to_json().dump() + "\n"),
-                                         [](boost::system::error_code, std::size_t) {});
-
-            } else if (message.type == "send_message") {
-                auto socket_it = client_usernames_.left.find("mudern");
-                auto& member_socket = socket_it->second;
-                // 处理发送消息请求
-                send_message_to_channel(message.channel, message.content, message.username);
+                dispatch_request(session, message);
             }
+            // 清除已处理的完整行，不完整的行留给下一次读取
+            session->read_buffer.erase(0, begin);
+            session->dispatch_arena.release();
 
-            // 继续监听同一个客户端的消息
-            handle_client(socket_ptr);
-        }else{
+            // 移交期间停止读取，剩余字节留在读缓冲中交给新进程
+            if (!upgrading_) {
+                // 继续监听同一个客户端的消息
+                handle_client(session);
+            }
+        } else if (ec == boost::asio::error::operation_aborted && upgrading_) {
+            // 移交时取消的读操作，会话由新进程继续处理
+        } else {
             std::cerr << "[Error] Read error: " << ec.message() << ", possible client disconnect." << std::endl;
+            close_session(session);
         }
     });
 }
 
 /**
- * @brief 向频道中的所有客户端发送消息
+ * @brief 根据请求类型分发处理
+ * @param session 发出请求的客户端会话
+ * @param message 解析后的请求
+ */
+void ServerNetwork::dispatch_request(const std::shared_ptr<ClientSession>& session, const RequestMessage& message) {
+    if (message.type == "connect") {
+        // 处理连接请求，将用户名与会话关联
+        // 客户端重连时旧会话可能尚未检测到断开，用新会话替换旧的映射
+        std::string username(message.username);
+        client_usernames_.left.erase(username);
+        client_usernames_.right.erase(session);
+        client_usernames_.insert({username, session});
+
+        // 发送确认消息
+        ResponseMessage response_message = {"connect", "success", "Username registered"};
+        reply(session, response_message, message);
+
+    } else if (message.type == "get_channel_list") {
+        // 处理获取频道列表请求，使用 JSON 数组返回
+        nlohmann::json channel_list_json = channels_;
+
+        // 使用 ResponseMessage 构建频道列表响应
+        ResponseMessage response_message = {"channel_list", "success", channel_list_json};
+        reply(session, response_message, message);
+
+    } else if (message.type == "join_channel") {
+        // 处理加入频道请求，切换到新频道并退订其他所有频道，兼容只使用单个频道的客户端
+        std::string username(message.username);
+        std::string new_channel_name(message.channel);
+        if (!has_channel(new_channel_name)) {
+            // 不存在的频道不会被创建，用户保持原有的订阅
+            ResponseMessage response_message = {"join_channel", "error", "Unknown channel: " + new_channel_name};
+            reply(session, response_message, message);
+            return;
+        }
+
+        // 成员变化前发出已攒的广播，批量内的接收者与入队时一致
+        for (const auto& channel_name : router_.subscriptions(username)) {
+            flush_broadcast(channel_name);
+        }
+        flush_broadcast(new_channel_name);
+        for (const auto& channel_name : router_.unsubscribe_all(username)) {
+            std::cout << "User " << username << " removed from channel " << channel_name << std::endl;
+        }
+
+        // 将用户加入到新的频道
+        router_.subscribe(new_channel_name, username);
+        std::cout << "User " << username << " joined channel " << new_channel_name << std::endl;
+
+        // 发送加入频道确认消息，使用 ResponseMessage 结构体
+        ResponseMessage response_message = {"join_channel", "success", "Joined " + new_channel_name};
+        reply(session, response_message, message);
+
+    } else if (message.type == "subscribe" || message.type == "unsubscribe") {
+        // 处理订阅和退订请求，不影响用户的其他订阅
+        std::string username(message.username);
+        std::string channel_name(message.channel);
+        if (message.type == "subscribe" && !has_channel(channel_name)) {
+            // 不存在的频道不会被创建
+            ResponseMessage response_message = {"subscribe", "error", "Unknown channel: " + channel_name};
+            reply(session, response_message, message);
+            return;
+        }
+        flush_broadcast(channel_name);
+        if (message.type == "subscribe") {
+            router_.subscribe(channel_name, username);
+            std::cout << "User " << username << " subscribed to channel " << channel_name << std::endl;
+        } else {
+            router_.unsubscribe(channel_name, username);
+            std::cout << "User " << username << " unsubscribed from channel " << channel_name << std::endl;
+        }
+
+        // 回复中附带用户当前的全部订阅
+        ResponseMessage response_message = {message.type, "success",
+                                            {{"channel", channel_name},
+                                             {"subscriptions", router_.subscriptions(username)}}};
+        reply(session, response_message, message);
+
+    } else if (message.type == "send_message") {
+        // 处理发送消息请求
+        send_message_to_channel(message);
+
+    } else if (message.type == "search") {
+        // 处理频道历史搜索请求
+        search_channel(session, message);
+
+    } else if (message.type == "get_history") {
+        // 处理增量获取频道历史请求
+        fetch_channel_history(session, message);
+    }
+}
+
+/**
+ * @brief 在频道历史中搜索，结果在后台线程查询完成后回到 I/O 线程发送
+ * @param session 发出请求的客户端会话
+ * @param message 搜索请求，content 为搜索文本，page 为页码
+ */
+void ServerNetwork::search_channel(const std::shared_ptr<ClientSession>& session, const RequestMessage& message) {
+    if (!history_) {
+        ResponseMessage response_message = {"search_result", "error", "History is not enabled"};
+        reply(session, response_message, message);
+        return;
+    }
+
+    static constexpr std::size_t page_size = 20;
+    // 移交前要等这些回复进入写队列
+    ++pending_history_replies_;
+    history_->search(std::string(message.channel), std::string(message.content), message.page, page_size,
+                     [this, session, message](std::vector<HistoryRecord> records, bool has_more) {
+        json results = json::array();
+        for (const auto& record : records) {
+            results.push_back({
+                    {"seq", record.seq},
+                    {"sender", record.sender},
+                    {"content", record.content},
+                    {"timestamp", record.timestamp},
+                    {"rank", record.rank}
+            });
+        }
+        ResponseMessage response_message = {"search_result", "success",
+                                            {{"channel", message.channel}, {"query", message.content},
+                                             {"page", message.page}, {"has_more", has_more}, {"results", results}}};
+        auto frame = encode_response(response_message, message);
+        // 在后台线程完成序列化，只把写操作和统计投递回 I/O 线程
+        boost::asio::post(io_context_, [this, session, frame, trace = response_message.trace]() {
+            --pending_history_replies_;
+            std::int64_t traced_since_ns = 0;
+            if (trace.is_object()) {
+                traced_since_ns = trace["server_send_ns"].get<std::int64_t>();
+                trace_histograms_["server_dispatch"].record(
+                        traced_since_ns - trace["server_dispatch_ns"].get<std::int64_t>());
+            }
+            write_to_session(session, frame, traced_since_ns);
+        });
+    });
+}
+
+/**
+ * @brief 返回频道中序号大于 after_seq 的消息，最多返回最新的一段，更早的由 truncated 标记
+ * @param session 发出请求的客户端会话
+ * @param message 获取历史请求，after_seq 为客户端缓存中的最大序号
+ */
+void ServerNetwork::fetch_channel_history(const std::shared_ptr<ClientSession>& session,
+                                          const RequestMessage& message) {
+    if (!history_) {
+        ResponseMessage response_message = {"history", "error", "History is not enabled"};
+        reply(session, response_message, message);
+        return;
+    }
+
+    static constexpr std::size_t fetch_limit = 200;
+    ++pending_history_replies_;
+    history_->fetch_after(std::string(message.channel), message.after_seq, fetch_limit,
+                          [this, session, message](std::vector<HistoryRecord> records, bool truncated) {
+        json messages = json::array();
+        for (const auto& record : records) {
+            messages.push_back({
+                    {"seq", record.seq},
+                    {"sender", record.sender},
+                    {"content", record.content},
+                    {"timestamp", record.timestamp}
+            });
+        }
+        ResponseMessage response_message = {"history", "success",
+                                            {{"channel", message.channel}, {"after_seq", message.after_seq},
+                                             {"epoch", history_->epoch()}, {"truncated", truncated},
+                                             {"messages", messages}}};
+        auto frame = encode_response(response_message, message);
+        boost::asio::post(io_context_, [this, session, frame, trace = response_message.trace]() {
+            --pending_history_replies_;
+            std::int64_t traced_since_ns = 0;
+            if (trace.is_object()) {
+                traced_since_ns = trace["server_send_ns"].get<std::int64_t>();
+                trace_histograms_["server_dispatch"].record(
+                        traced_since_ns - trace["server_dispatch_ns"].get<std::int64_t>());
+            }
+            write_to_session(session, frame, traced_since_ns);
+        });
+    });
+}
+
+/**
+ * @brief 序列化回复；请求被采样时回传追踪时间戳并附加服务器发送时间
+ * @param response 待发送的回复
+ * @param request 对应的请求
+ * @return 已序列化的帧，以换行结尾
+ */
+std::shared_ptr<const std::string> ServerNetwork::encode_response(ResponseMessage& response,
+                                                                  const RequestMessage& request) {
+    if (request.trace.is_object()) {
+        response.trace = request.trace;
+        response.trace["server_send_ns"] = monotonic_now_ns();
+    }
+    return std::make_shared<const std::string>(encode_frame(response));
+}
+
+/**
+ * @brief 回复给请求者，请求被采样时统计分发耗时和写完成耗时
+ * @param session 目标会话
+ * @param response 待发送的回复
+ * @param request 对应的请求
+ */
+void ServerNetwork::reply(const std::shared_ptr<ClientSession>& session, ResponseMessage response,
+                          const RequestMessage& request) {
+    auto frame = encode_response(response, request);
+    std::int64_t traced_since_ns = 0;
+    if (response.trace.is_object()) {
+        traced_since_ns = response.trace["server_send_ns"].get<std::int64_t>();
+        trace_histograms_["server_dispatch"].record(
+                traced_since_ns - response.trace["server_dispatch_ns"].get<std::int64_t>());
+    }
+    write_to_session(session, frame, traced_since_ns);
+}
+
+/**
+ * @brief 把一帧数据放入客户端会话的写队列
+ * @param session 目标会话
+ * @param frame 已序列化的帧，以换行结尾，写完成前由队列和回调持有
+ * @param traced_since_ns 采样帧的入队时间，未采样为 0
+ */
+void ServerNetwork::write_to_session(const std::shared_ptr<ClientSession>& session,
+                                     std::shared_ptr<const std::string> frame, std::int64_t traced_since_ns) {
+    if (frame->size() > kChunkThreshold) {
+        write_chunks_to_session(session, encode_chunks(*frame), traced_since_ns);
+        return;
+    }
+    session->priority_queue.push_back({std::move(frame), traced_since_ns});
+    pump_writes(session);
+}
+
+/**
+ * @brief 把大帧编码为分块帧，分配服务器内唯一的传输编号
+ * @param frame 已序列化的帧，以换行结尾
+ * @return 全部分块帧，可由多个接收者共享
+ */
+std::shared_ptr<const std::vector<std::string>> ServerNetwork::encode_chunks(const std::string& frame) {
+    // 分块内容不含结尾换行，客户端拼接完整后按普通帧解析
+    std::string_view content(frame);
+    content.remove_suffix(1);
+    std::uint32_t id = next_transfer_id_++;
+    auto chunks = std::make_shared<std::vector<std::string>>();
+    chunks->reserve(content.size() / kChunkSize + 1);
+    std::size_t offset = 0;
+    for (std::uint32_t index = 0; offset < content.size(); ++index) {
+        chunks->push_back(encode_chunk(id, index, content, offset));
+    }
+    return chunks;
+}
+
+/**
+ * @brief 把已编码的分块放入客户端会话的大块队列
+ * @param session 目标会话
+ * @param chunks 全部分块帧，写完成前由队列和回调持有
+ * @param traced_since_ns 采样帧的入队时间，未采样为 0
+ */
+void ServerNetwork::write_chunks_to_session(const std::shared_ptr<ClientSession>& session,
+                                            std::shared_ptr<const std::vector<std::string>> chunks,
+                                            std::int64_t traced_since_ns) {
+    BulkTransfer transfer;
+    transfer.chunks = std::move(chunks);
+    transfer.traced_since_ns = traced_since_ns;
+    session->bulk_queue.push_back(std::move(transfer));
+    pump_writes(session);
+}
+
+/**
+ * @brief 从写队列中取出下一帧发送，优先队列先于大块分块
+ * @param session 目标会话
+ */
+void ServerNetwork::pump_writes(const std::shared_ptr<ClientSession>& session) {
+    if (session->writing) return;
+
+    OutboundFrame frame;
+    if (!session->priority_queue.empty()) {
+        frame = std::move(session->priority_queue.front());
+        session->priority_queue.pop_front();
+    } else if (!session->bulk_queue.empty()) {
+        frame = next_chunk(*session);
+    } else {
+        return;
+    }
+
+    session->writing = true;
+    boost::asio::async_write(*session->socket, boost::asio::buffer(*frame.data),
+                             [this, session, frame](boost::system::error_code ec, std::size_t) {
+        session->writing = false;
+        if (ec) {
+            // 连接已经不可用，丢弃剩余的待发送数据
+            session->priority_queue.clear();
+            session->bulk_queue.clear();
+            return;
+        }
+        if (frame.traced_since_ns != 0) {
+            trace_histograms_["server_write"].record(monotonic_now_ns() - frame.traced_since_ns);
+        }
+        pump_writes(session);
+    });
+}
+
+/**
+ * @brief 取出大块队列队首传输的下一个分块，并把该传输轮换到队尾
+ * @param session 目标会话
+ * @return 分块帧，只有最后一块带有追踪入队时间
+ */
+OutboundFrame ServerNetwork::next_chunk(ClientSession& session) {
+    BulkTransfer transfer = std::move(session.bulk_queue.front());
+    session.bulk_queue.pop_front();
+
+    // 分块帧与共享的分块列表同生命周期，不复制
+    std::shared_ptr<const std::string> data(transfer.chunks, &(*transfer.chunks)[transfer.next]);
+    if (++transfer.next == transfer.chunks->size()) {
+        return {std::move(data), transfer.traced_since_ns};
+    }
+    session.bulk_queue.push_back(std::move(transfer));
+    return {std::move(data), 0};
+}
+
+/**
+ * @brief 频道是否在服务器的频道列表中
  * @param channel 频道名称
- * @param message 消息内容
- * @param sender 消息发送者的用户名
  */
-void ServerNetwork::send_message_to_channel(const std::string& channel, const std::string& message, const std::string& sender) {
-    auto it = channel_members_.find(channel);
-    if (it != channel_members_.end()) {
+bool ServerNetwork::has_channel(const std::string& channel) const {
+    return std::find(channels_.begin(), channels_.end(), channel) != channels_.end();
+}
+
+/**
+ * @brief 移除断开的客户端会话
+ * @param session 断开的会话
+ */
+void ServerNetwork::close_session(const std::shared_ptr<ClientSession>& session) {
+    if (capture_) {
+        capture_->record_close(session->id);
+    }
+    sessions_.erase(session->id);
+    client_usernames_.right.erase(session);
+}
+
+/**
+ * @brief 向频道中的所有客户端发送消息
+ * @param request 发送消息请求，包含频道、内容、发送者和追踪时间戳
+ */
+void ServerNetwork::send_message_to_channel(const RequestMessage& request) {
+    const std::string channel(request.channel);
+    const std::pmr::string& message = request.content;
+    const std::pmr::string& sender = request.username;
+    auto it = router_.channels().find(channel);
+    if (it != router_.channels().end()) {
         // 使用 ResponseMessage 结构体构建要发送的消息
         ResponseMessage full_message = {"send_message", "success",
                                             {{"sender", sender}, {"channel", channel}, {"content", message}}};
+        if (history_) {
+            // 保存消息并附带频道内序号
+            full_message.content["seq"] = history_->append(channel, sender, message);
+        }
 
-        std::string full_message_str = full_message.to_json().dump() + "\n";  // 序列化为 JSON 字符串
+        // 序列化为 JSON 字符串，所有成员共享同一份；采样的消息对所有成员都携带追踪时间戳
+        auto full_message_str = encode_response(full_message, request);
+        std::int64_t traced_since_ns = 0;
+        if (full_message.trace.is_object()) {
+            traced_since_ns = full_message.trace["server_send_ns"].get<std::int64_t>();
+            trace_histograms_["server_dispatch"].record(
+                    traced_since_ns - full_message.trace["server_dispatch_ns"].get<std::int64_t>());
+        }
+
+        auto batch_it = channel_batches_.find(channel);
+        if (batch_it != channel_batches_.end()) {
+            if (batch_it->second.window.count() > 0 && !upgrading_ && full_message_str->size() <= kChunkThreshold) {
+                batch_broadcast(channel, batch_it->second, std::move(full_message_str), traced_since_ns);
+                return;
+            }
+            // 大消息不攒批，先发出窗口内已有的消息以保持顺序
+            flush_broadcast(channel);
+        }
+
+        // 大消息只编码一次分块，所有成员共享同一份分块帧
+        std::shared_ptr<const std::vector<std::string>> chunks;
+        if (full_message_str->size() > kChunkThreshold) {
+            chunks = encode_chunks(*full_message_str);
+        }
 
         // 遍历该频道的所有成员，发送消息
         for (const auto& username : it->second) {
-            // 查找用户名对应的 socket
-            auto socket_it = client_usernames_.left.find(username);
-            if (socket_it != client_usernames_.left.end()) {
+            // 查找用户名对应的会话
+            auto session_it = client_usernames_.left.find(username);
+            if (session_it != client_usernames_.left.end()) {
                 std::cout << "Sending to user: " << username << std::endl;
-                auto& member_socket = socket_it->second;  // 获取对应的 socket
-                // 使用 async_write 发送消息给客户端
-                boost::asio::async_write(*member_socket, boost::asio::buffer(full_message_str),
-                                         [](boost::system::error_code, std::size_t) {});
+                if (chunks) {
+                    write_chunks_to_session(session_it->second, chunks, traced_since_ns);
+                } else {
+                    write_to_session(session_it->second, full_message_str, traced_since_ns);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief 把一帧广播放入频道的批量缓冲，必要时启动窗口定时器
+ * @param channel 频道名称
+ * @param batch 频道的批量缓冲
+ * @param frame 已序列化的广播帧
+ * @param traced_since_ns 采样帧的入队时间，未采样为 0
+ */
+void ServerNetwork::batch_broadcast(const std::string& channel, ChannelBatch& batch,
+                                    std::shared_ptr<const std::string> frame, std::int64_t traced_since_ns) {
+    if (batch.frames.empty()) {
+        // 接收者按入队时的成员确定，窗口内成员变化前已攒的帧会先发出
+        for (const auto& username : router_.subscribers(channel)) {
+            auto session_it = client_usernames_.left.find(username);
+            if (session_it != client_usernames_.left.end()) {
+                batch.recipients.push_back(session_it->second);
+            }
+        }
+    }
+    batch.bytes += frame->size();
+    batch.frames.push_back({std::move(frame), traced_since_ns});
+    if (batch.bytes >= kChunkThreshold) {
+        // 攒够一个分块阈值就立即发送，拼接后的块不会太大而影响交互流量
+        flush_broadcast(channel);
+        return;
+    }
+    if (!batch.scheduled) {
+        // 窗口从第一帧入队开始计时，帧的额外延迟不超过窗口
+        batch.scheduled = true;
+        batch.timer.expires_after(batch.window);
+        batch.timer.async_wait([this, channel](error_code ec) {
+            if (!ec) flush_broadcast(channel);
+        });
+    }
+}
+
+/**
+ * @brief 把频道批量缓冲中的帧拼接成一块，发给入队时的频道成员
+ *
+ * 拼接后的块由所有成员共享，按行分隔，客户端无需任何改动。
+ * @param channel 频道名称
+ */
+void ServerNetwork::flush_broadcast(const std::string& channel) {
+    auto batch_it = channel_batches_.find(channel);
+    if (batch_it == channel_batches_.end()) return;
+    ChannelBatch& batch = batch_it->second;
+    if (batch.scheduled) {
+        batch.scheduled = false;
+        batch.timer.cancel();
+    }
+    if (batch.frames.empty()) return;
+
+    std::int64_t now_ns = monotonic_now_ns();
+    std::int64_t traced_since_ns = 0;
+    std::shared_ptr<const std::string> combined;
+    if (batch.frames.size() == 1) {
+        combined = batch.frames.front().data;
+    } else {
+        auto data = std::make_shared<std::string>();
+        data->reserve(batch.bytes);
+        for (const auto& frame : batch.frames) {
+            data->append(*frame.data);
+        }
+        combined = std::move(data);
+    }
+    for (const auto& frame : batch.frames) {
+        if (frame.traced_since_ns != 0) {
+            trace_histograms_["server_batch"].record(now_ns - frame.traced_since_ns);
+            // 写完成耗时从最早的采样帧入队算起
+            if (traced_since_ns == 0) traced_since_ns = frame.traced_since_ns;
+        }
+    }
+    batch.frames.clear();
+    batch.bytes = 0;
+
+    std::vector<std::shared_ptr<ClientSession>> recipients = std::move(batch.recipients);
+    batch.recipients.clear();
+    for (const auto& session : recipients) {
+        // 窗口内断开的会话不再发送
+        if (!sessions_.count(session->id)) continue;
+        // 直接进入优先队列，拼接块不拆分成分块传输
+        session->priority_queue.push_back({combined, traced_since_ns});
+        pump_writes(session);
+    }
+}
+
+/**
+ * @brief 设置频道的广播批量窗口
+ * @param channel 频道名称，"*" 表示所有频道
+ * @param window 批量窗口，0 表示关闭
+ * @return 频道不存在时返回 false
+ */
+bool ServerNetwork::set_broadcast_window(const std::string& channel, std::chrono::microseconds window) {
+    if (channel == "*") {
+        for (const auto& name : channels_) {
+            set_broadcast_window(name, window);
+        }
+        return true;
+    }
+    if (!has_channel(channel)) {
+        std::cerr << "[Server] Unknown channel for broadcast window: " << channel << std::endl;
+        return false;
+    }
+    auto [batch_it, inserted] = channel_batches_.try_emplace(channel, io_context_);
+    // 缩短或关闭窗口前先发出已攒的消息
+    flush_broadcast(channel);
+    batch_it->second.window = std::max(window, std::chrono::microseconds(0));
+    std::cout << "[Server] Broadcast window for " << channel << ": " << batch_it->second.window.count() << " us"
+              << std::endl;
+    return true;
+}
+
+/**
+ * @brief 序列化频道与会话状态，用于移交给新进程
+ * @param sessions 移交的会话，顺序与描述符顺序一致
+ */
+json ServerNetwork::snapshot_state(const std::vector<std::shared_ptr<ClientSession>>& sessions) const {
+    json session_list = json::array();
+    for (const auto& session : sessions) {
+        auto name_it = client_usernames_.right.find(session);
+        session_list.push_back({
+                {"id", session->id},
+                {"username", name_it != client_usernames_.right.end() ? name_it->second : ""},
+                {"read_buffer_base64", base64_encode(session->read_buffer)}
+        });
+    }
+    json batch_windows = json::object();
+    for (const auto& [channel, batch] : channel_batches_) {
+        batch_windows[channel] = batch.window.count();
+    }
+    json state = {
+            {"family", acceptor_.local_endpoint().protocol() == tcp::v6() ? "v6" : "v4"},
+            {"channels", channels_},
+            {"channel_members", router_.channels()},
+            {"next_session_id", next_session_id_},
+            {"next_transfer_id", next_transfer_id_},
+            {"batch_windows", batch_windows},
+            {"history_path", history_path_},
+            {"sessions", session_list}
+    };
+    if (capture_) {
+        state["capture"] = {{"path", capture_path_}, {"start_ns", capture_->start_ns()}};
+    }
+    return state;
+}
+
+/**
+ * @brief 定期打印服务器端的延迟追踪直方图，没有采样时不输出
+ */
+void ServerNetwork::schedule_trace_report() {
+    trace_report_timer_.expires_after(std::chrono::seconds(60));
+    trace_report_timer_.async_wait([this](error_code ec) {
+        if (ec) return;
+        if (!trace_histograms_.empty()) {
+            json report = json::object();
+            for (const auto& [stage, histogram] : trace_histograms_) {
+                report[stage] = histogram.to_json();
             }
+            std::cout << "[Trace] " << report.dump() << std::endl;
+        }
+        schedule_trace_report();
+    });
+}
+
+/**
+ * @brief 开启聊天记录存储和全文搜索
+ * @param db_path SQLite 数据库文件路径
+ */
+void ServerNetwork::enable_history(const std::string& db_path) {
+    if (history_ && history_path_ == db_path) {
+        return;
+    }
+    history_ = std::make_unique<ChatHistory>(db_path);
+    history_path_ = db_path;
+}
+
+/**
+ * @brief 开启入站流量抓包
+ * @param path 抓包文件路径，已存在时覆盖
+ */
+void ServerNetwork::enable_capture(const std::string& path) {
+    if (capture_ && capture_path_ == path) {
+        return;
+    }
+    capture_ = std::make_unique<TrafficCapture>(path);
+    capture_path_ = path;
+    std::cout << "[Capture] Recording inbound traffic to " << path << std::endl;
+    schedule_capture_flush();
+}
+
+/**
+ * @brief 定期把抓包缓冲写入文件
+ */
+void ServerNetwork::schedule_capture_flush() {
+    capture_flush_timer_.expires_after(std::chrono::milliseconds(100));
+    capture_flush_timer_.async_wait([this](error_code ec) {
+        if (ec || !capture_) return;
+        capture_->flush();
+        schedule_capture_flush();
+    });
+}
+
+#ifdef HACK_CHAT_HAS_UPGRADE_HANDOFF
+
+/**
+ * @brief 开启平滑升级模式，在指定路径监听新进程的接管请求
+ * @param upgrade_path 升级控制 Unix 域套接字路径
+ */
+bool ServerNetwork::enable_upgrade(const std::string& upgrade_path) {
+    using local = boost::asio::local::stream_protocol;
+    // 上一个进程遗留的路径会导致 bind 失败，移交完成后新进程会重新绑定该路径
+    ::unlink(upgrade_path.c_str());
+    error_code ec;
+    auto upgrade_acceptor = std::make_unique<local::acceptor>(io_context_);
+    upgrade_acceptor->open(local(), ec);
+    if (!ec) upgrade_acceptor->bind(local::endpoint(upgrade_path), ec);
+    if (!ec) upgrade_acceptor->listen(boost::asio::socket_base::max_listen_connections, ec);
+    if (ec) {
+        std::cerr << "[Upgrade] Failed to listen on " << upgrade_path << ": " << ec.message() << std::endl;
+        return false;
+    }
+    upgrade_acceptor_ = std::move(upgrade_acceptor);
+    accept_upgrade();
+    return true;
+}
+
+/**
+ * @brief 等待升级控制连接
+ */
+void ServerNetwork::accept_upgrade() {
+    auto peer = std::make_shared<boost::asio::local::stream_protocol::socket>(io_context_);
+    upgrade_acceptor_->async_accept(*peer, [this, peer](error_code ec) {
+        if (ec) {
+            if (ec != boost::asio::error::operation_aborted) accept_upgrade();
+            return;
+        }
+        begin_handoff(peer);
+    });
+}
+
+/**
+ * @brief 开始向新进程移交：停止接受连接和读取请求，等待写完成后发送状态
+ * @param peer 与新进程的 Unix 域连接
+ */
+void ServerNetwork::begin_handoff(std::shared_ptr<boost::asio::local::stream_protocol::socket> peer) {
+    std::cout << "[Upgrade] New process connected, handing off " << sessions_.size() << " sessions" << std::endl;
+    upgrading_ = true;
+
+    // 停止接受新连接，之后完成的读请求不再重新发起
+    error_code ec;
+    acceptor_.cancel(ec);
+    boost::asio::post(io_context_, [this, peer]() {
+        drain_and_handoff(peer, std::chrono::steady_clock::now() + std::chrono::seconds(5), false);
+    });
+}
+
+/**
+ * @brief 等待历史查询的回复和所有会话的异步写完成，再取消挂起的读后移交，超时则放弃本次升级
+ *
+ * socket 的 cancel 会同时取消读和写，因此必须先等写完成再取消读，
+ * 避免把写了一半的帧或未发完的分块传输留给新进程。
+ * @param peer 与新进程的 Unix 域连接
+ * @param deadline 最长等待时间点
+ * @param reads_cancelled 挂起的读是否已经取消
+ */
+void ServerNetwork::drain_and_handoff(std::shared_ptr<boost::asio::local::stream_protocol::socket> peer,
+                                      std::chrono::steady_clock::time_point deadline, bool reads_cancelled) {
+    // 移交前发出所有频道攒着的广播
+    for (auto& [channel, batch] : channel_batches_) {
+        flush_broadcast(channel);
+    }
+    // 已提交的搜索和历史请求的回复也要先发出，否则会随旧进程丢失
+    bool drained = pending_history_replies_ == 0 &&
+                   std::all_of(sessions_.begin(), sessions_.end(), [](const auto& entry) {
+        return entry.second->write_idle();
+    });
+    if (!drained && std::chrono::steady_clock::now() < deadline) {
+        drain_timer_.expires_after(std::chrono::milliseconds(10));
+        drain_timer_.async_wait([this, peer, deadline, reads_cancelled](error_code) {
+            drain_and_handoff(peer, deadline, reads_cancelled);
+        });
+        return;
+    }
+    if (!drained) {
+        // 移交写了一半的帧会让客户端收到错乱的数据，宁可放弃本次升级；关闭控制连接后新进程接管失败并退出
+        std::cerr << "[Upgrade] Timed out waiting for pending writes, aborting upgrade." << std::endl;
+        error_code ec;
+        peer->close(ec);
+        std::vector<std::shared_ptr<ClientSession>> sessions;
+        for (auto& [id, session] : sessions_) {
+            sessions.push_back(session);
+        }
+        resume_after_handoff(sessions);
+        return;
+    }
+    if (!reads_cancelled) {
+        // 已读取的字节保留在各会话的读缓冲中，让被取消的回调先执行完再检查一次
+        error_code ec;
+        for (auto& [id, session] : sessions_) {
+            session->socket->cancel(ec);
+        }
+        boost::asio::post(io_context_, [this, peer, deadline]() {
+            drain_and_handoff(peer, deadline, true);
+        });
+        return;
+    }
+
+    std::vector<std::shared_ptr<ClientSession>> sessions;
+    std::vector<int> fds = {acceptor_.native_handle()};
+    for (auto& [id, session] : sessions_) {
+        sessions.push_back(session);
+        fds.push_back(session->socket->native_handle());
+    }
+
+    // 新进程会从数据库读取各频道的最大序号，移交前必须写完所有已追加的消息
+    if (history_) {
+        history_->flush();
+    }
+    // 新进程会追加写入同一个抓包文件，先把本进程缓冲的记录写出
+    if (capture_) {
+        capture_->flush();
+    }
+
+    std::string state = snapshot_state(sessions).dump();
+    if (!send_upgrade_handoff(peer->native_handle(), state, fds)) {
+        // 移交失败，本进程继续提供服务
+        std::cerr << "[Upgrade] Handoff failed, resuming service." << std::endl;
+        resume_after_handoff(sessions);
+        return;
+    }
+
+    // 之后由新进程写抓包文件
+    capture_.reset();
+    capture_flush_timer_.cancel();
+
+    // 新进程已持有描述符副本，这里只关闭本进程的描述符，不会断开客户端连接
+    error_code ec;
+    upgrade_acceptor_->close(ec);
+    acceptor_.close(ec);
+    for (auto& session : sessions) {
+        session->socket->close(ec);
+    }
+    sessions_.clear();
+    client_usernames_.clear();
+    std::cout << "[Upgrade] Handoff complete, old process exiting." << std::endl;
+    io_context_.stop();
+}
+
+/**
+ * @brief 放弃移交，恢复接受连接和读取请求
+ * @param sessions 需要恢复读取的会话，读操作仍在进行的会话保持不变
+ */
+void ServerNetwork::resume_after_handoff(const std::vector<std::shared_ptr<ClientSession>>& sessions) {
+    upgrading_ = false;
+    accept_connection();
+    accept_upgrade();
+    for (const auto& session : sessions) {
+        if (!session->reading) {
+            handle_client(session);
         }
     }
 }
+
+#else
+
+bool ServerNetwork::enable_upgrade(const std::string& upgrade_path) {
+    std::cerr << "[Upgrade] Graceful upgrade is not supported on this platform: " << upgrade_path << std::endl;
+    return false;
+}
+
+#endif
@@ -0,0 +1,130 @@
+//
+// Created by 穆琰鑫 on 2024/10/26.
+//
+
+#include "../include/TrafficCapture.h"
+#include "../include/LatencyTrace.h"
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+/// 文件头魔数，最后一个字节为格式版本
+static constexpr char kCaptureMagic[8] = {'H', 'C', 'C', 'A', 'P', 'T', 'R', '1'};
+/// 每条记录头的字节数：时间偏移、会话编号、类型、长度
+static constexpr std::size_t kRecordHeaderSize = 8 + 4 + 1 + 4;
+
+/*
+ * 以小端序写入整数
+ */
+template <typename T>
+static char* put_le(char* out, T value) {
+    auto bits = static_cast<std::uint64_t>(value);
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        *out++ = static_cast<char>((bits >> (8 * i)) & 0xFF);
+    }
+    return out;
+}
+
+/*
+ * 以小端序读取整数
+ */
+template <typename T>
+static const unsigned char* get_le(const unsigned char* in, T& value) {
+    std::uint64_t bits = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        bits |= static_cast<std::uint64_t>(in[i]) << (8 * i);
+    }
+    value = static_cast<T>(bits);
+    return in + sizeof(T);
+}
+
+TrafficCapture::TrafficCapture(const std::string& path) {
+    file_ = std::fopen(path.c_str(), "wb");
+    if (!file_) {
+        throw std::runtime_error("failed to create capture file " + path);
+    }
+    // 加大缓冲，减少 I/O 线程中的系统调用
+    std::setvbuf(file_, nullptr, _IOFBF, 1 << 20);
+
+    char header[sizeof(kCaptureMagic) + 8];
+    std::memcpy(header, kCaptureMagic, sizeof(kCaptureMagic));
+    put_le<std::int64_t>(header + sizeof(kCaptureMagic), std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+    std::fwrite(header, 1, sizeof(header), file_);
+    std::fflush(file_);
+
+    start_ns_ = monotonic_now_ns();
+}
+
+TrafficCapture::TrafficCapture(const std::string& path, std::int64_t start_ns) : start_ns_(start_ns) {
+    file_ = std::fopen(path.c_str(), "ab");
+    if (!file_) {
+        throw std::runtime_error("failed to open capture file " + path);
+    }
+    std::setvbuf(file_, nullptr, _IOFBF, 1 << 20);
+}
+
+TrafficCapture::~TrafficCapture() {
+    std::fclose(file_);
+}
+
+void TrafficCapture::record_frame(std::uint32_t session_id, std::string_view frame) {
+    write_record(session_id, CaptureRecord::frame, frame);
+}
+
+void TrafficCapture::record_open(std::uint32_t session_id) {
+    write_record(session_id, CaptureRecord::open, std::string_view());
+}
+
+void TrafficCapture::record_close(std::uint32_t session_id) {
+    write_record(session_id, CaptureRecord::close, std::string_view());
+}
+
+void TrafficCapture::write_record(std::uint32_t session_id, CaptureRecord::Kind kind, std::string_view data) {
+    char header[kRecordHeaderSize];
+    char* out = put_le<std::int64_t>(header, monotonic_now_ns() - start_ns_);
+    out = put_le<std::uint32_t>(out, session_id);
+    out = put_le<std::uint8_t>(out, kind);
+    put_le<std::uint32_t>(out, static_cast<std::uint32_t>(data.size()));
+    std::fwrite(header, 1, sizeof(header), file_);
+    std::fwrite(data.data(), 1, data.size(), file_);
+}
+
+void TrafficCapture::flush() {
+    std::fflush(file_);
+}
+
+CaptureReader::CaptureReader(const std::string& path) {
+    file_ = std::fopen(path.c_str(), "rb");
+    if (!file_) {
+        throw std::runtime_error("failed to open capture file " + path);
+    }
+    unsigned char header[sizeof(kCaptureMagic) + 8];
+    if (std::fread(header, 1, sizeof(header), file_) != sizeof(header) ||
+        std::memcmp(header, kCaptureMagic, sizeof(kCaptureMagic)) != 0) {
+        std::fclose(file_);
+        throw std::runtime_error("not a hack_chat capture file: " + path);
+    }
+    get_le(header + sizeof(kCaptureMagic), started_at_ms_);
+}
+
+CaptureReader::~CaptureReader() {
+    std::fclose(file_);
+}
+
+bool CaptureReader::next(CaptureRecord& record) {
+    unsigned char header[kRecordHeaderSize];
+    if (std::fread(header, 1, sizeof(header), file_) != sizeof(header)) {
+        return false;
+    }
+    std::uint8_t kind = 0;
+    std::uint32_t length = 0;
+    const unsigned char* in = get_le(header, record.offset_ns);
+    in = get_le(in, record.session_id);
+    in = get_le(in, kind);
+    get_le(in, length);
+    record.kind = static_cast<CaptureRecord::Kind>(kind);
+
+    record.data.resize(length);
+    return length == 0 || std::fread(record.data.data(), 1, length, file_) == length;
+}
@@ -0,0 +1,158 @@
+//
+// Created by 穆琰鑫 on 2024/10/21.
+//
+
+#include "../include/UpgradeHandoff.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#ifdef HACK_CHAT_HAS_UPGRADE_HANDOFF
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/// 每条消息携带的描述符上限，低于内核的 SCM_MAX_FD
+static constexpr std::size_t kFdsPerMessage = 64;
+
+/*
+ * 完整写入指定字节数，处理被信号打断和部分写入
+ */
+static bool write_all(int fd, const char* data, std::size_t size) {
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        size -= static_cast<std::size_t>(written);
+    }
+    return true;
+}
+
+/*
+ * 完整读取指定字节数，对端提前关闭返回 false
+ */
+static bool read_all(int fd, char* data, std::size_t size) {
+    while (size > 0) {
+        ssize_t received = ::read(fd, data, size);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (received == 0) return false;
+        data += received;
+        size -= static_cast<std::size_t>(received);
+    }
+    return true;
+}
+
+/*
+ * 发送一批描述符，负载只有一个字节，描述符放在控制消息中
+ */
+static bool send_fd_batch(int unix_fd, const int* fds, std::size_t count) {
+    char marker = 'F';
+    iovec iov{&marker, 1};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * count), 0);
+
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+    while (::sendmsg(unix_fd, &msg, 0) < 0) {
+        if (errno != EINTR) return false;
+    }
+    return true;
+}
+
+/*
+ * 接收一批描述符，追加到 fds 末尾
+ */
+static bool receive_fd_batch(int unix_fd, std::vector<int>& fds) {
+    char marker = 0;
+    iovec iov{&marker, 1};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * kFdsPerMessage), 0);
+
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    ssize_t received;
+    while ((received = ::recvmsg(unix_fd, &msg, 0)) < 0) {
+        if (errno != EINTR) return false;
+    }
+    if (received == 0 || (msg.msg_flags & MSG_CTRUNC)) return false;
+
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const unsigned char* data = CMSG_DATA(cmsg);
+        for (std::size_t i = 0; i < count; ++i) {
+            int fd;
+            std::memcpy(&fd, data + i * sizeof(int), sizeof(int));
+            fds.push_back(fd);
+        }
+    }
+    return true;
+}
+
+bool send_upgrade_handoff(int unix_fd, const std::string& state, const std::vector<int>& fds) {
+    std::uint32_t header[2] = {static_cast<std::uint32_t>(state.size()), static_cast<std::uint32_t>(fds.size())};
+    if (!write_all(unix_fd, reinterpret_cast<const char*>(header), sizeof(header))) return false;
+    if (!write_all(unix_fd, state.data(), state.size())) return false;
+
+    for (std::size_t offset = 0; offset < fds.size(); offset += kFdsPerMessage) {
+        std::size_t count = std::min(kFdsPerMessage, fds.size() - offset);
+        if (!send_fd_batch(unix_fd, fds.data() + offset, count)) {
+            std::cerr << "[Upgrade] Failed to send descriptors: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool receive_upgrade_handoff(int unix_fd, std::string& state, std::vector<int>& fds) {
+    std::uint32_t header[2] = {0, 0};
+    if (!read_all(unix_fd, reinterpret_cast<char*>(header), sizeof(header))) return false;
+
+    state.resize(header[0]);
+    if (!read_all(unix_fd, state.data(), state.size())) return false;
+
+    fds.clear();
+    while (fds.size() < header[1]) {
+        if (!receive_fd_batch(unix_fd, fds)) {
+            std::cerr << "[Upgrade] Failed to receive descriptors: " << std::strerror(errno) << std::endl;
+            for (int fd : fds) ::close(fd);
+            fds.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+#else
+
+bool send_upgrade_handoff(int, const std::string&, const std::vector<int>&) {
+    std::cerr << "[Upgrade] Socket handoff is not supported on this platform." << std::endl;
+    return false;
+}
+
+bool receive_upgrade_handoff(int, std::string&, std::vector<int>&) {
+    std::cerr << "[Upgrade] Socket handoff is not supported on this platform." << std::endl;
+    return false;
+}
+
+#endif
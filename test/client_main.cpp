@@ -2,7 +2,10 @@
 // Created by 穆琰鑫 on 2024/10/15.
 //
 
+#include <chrono>
+#include <future>
 #include <iostream>
+#include <thread>
 #include "../include/NetWork.h"
 #include "../include/ChatClientGUI.h"
 
@@ -16,37 +19,62 @@ int main() {
         // 创建客户端网络类对象
         ClientNetwork client(server_address, server_port, username);
 
+        // 连接结果和频道列表都在 I/O 线程中通过回调返回
+        std::promise<bool> connected;
+        std::promise<std::vector<std::string>> channel_list;
+        client.setConnectionCallback([&connected](ConnectionEvent event, const std::string& detail) {
+            if (event == ConnectionEvent::connected || event == ConnectionEvent::failed) {
+                std::cout << "Connection event: " << detail << std::endl;
+                connected.set_value(event == ConnectionEvent::connected);
+            }
+        });
+        client.setChannelListCallback([&channel_list](const std::vector<std::string>& channels) {
+            channel_list.set_value(channels);
+        });
+        client.setMessageCallback([](const std::string& channel, const std::string& message) {
+            std::cout << "[" << channel << "] " << message << std::endl;
+        });
+
         // 尝试连接服务器
-        if (client.connect_to_server()) {
+        ConnectOptions options;
+        options.auto_reconnect = false;
+        client.set_connect_options(options);
+        client.async_connect();
+        std::thread io_thread([&client]() { client.io_context_.run(); });
+
+        if (connected.get_future().get()) {
             std::cout << "Connected to server as " << username << std::endl;
 
             // 获取频道列表
-            std::vector<std::string> channels = client.get_channel_list();
-            std::cout << "Available channels: ";
-            for (const auto& channel : channels) {
-                std::cout << channel << " ";
+            client.get_channel_list();
+            auto channels_future = channel_list.get_future();
+            if (channels_future.wait_for(std::chrono::seconds(5)) == std::future_status::ready) {
+                std::cout << "Available channels: ";
+                for (const auto& channel : channels_future.get()) {
+                    std::cout << channel << " ";
+                }
+                std::cout << std::endl;
             }
-            std::cout << std::endl;
 
-            // 加入一个频道
+            // 加入一个频道并发送一条消息
             std::string channel_to_join = "SciFi";
-            if (client.join_channel(channel_to_join)) {
-                std::cout << "Joined channel: " << channel_to_join << std::endl;
+            client.join_channel(channel_to_join);
+            std::cout << "Joined channel: " << channel_to_join << std::endl;
+            std::string message = "Hello, everyone!";
+            client.send_message(message);
+            std::cout << "Message sent: " << message << std::endl;
 
-                // 发送一条消息
-                std::string message = "Hello, everyone!";
-                if (client.send_message(message)) {
-                    std::cout << "Message sent: " << message << std::endl;
-                }
-            } else {
-                std::cerr << "Failed to join channel: " << channel_to_join << std::endl;
-            }
+            // 等待服务器广播回来
+            std::this_thread::sleep_for(std::chrono::seconds(1));
         } else {
             std::cerr << "Failed to connect to server" << std::endl;
         }
+
+        client.io_context_.stop();
+        io_thread.join();
     } catch (const std::exception& e) {
         std::cerr << "Client error: " << e.what() << std::endl;
     }
 
     return 0;
-}
\ No newline at end of file
+}
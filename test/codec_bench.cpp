@@ -0,0 +1,357 @@
+//
+// Created by 穆琰鑫 on 2024/10/20.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <vector>
+#include "../include/NetWork.h"
+
+/**
+ * @brief 全局分配计数器，用于统计每次编解码的堆分配次数和字节数
+ */
+static std::atomic<std::size_t> g_alloc_count{0};
+static std::atomic<std::size_t> g_alloc_bytes{0};
+
+void* operator new(std::size_t size) {
+    g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    g_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+// std::pmr 的内存资源走带对齐参数的版本，同样需要计数；
+// 多申请 align 字节用于对齐，并在返回地址之前保存 malloc 的原始地址
+void* operator new(std::size_t size, std::align_val_t align) {
+    g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    g_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    auto alignment = std::max(static_cast<std::size_t>(align), sizeof(void*));
+    void* raw = std::malloc(size + alignment + sizeof(void*));
+    if (!raw) {
+        throw std::bad_alloc();
+    }
+    auto address = reinterpret_cast<std::uintptr_t>(raw) + sizeof(void*);
+    address = (address + alignment - 1) & ~(static_cast<std::uintptr_t>(alignment) - 1);
+    reinterpret_cast<void**>(address)[-1] = raw;
+    return reinterpret_cast<void*>(address);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    if (ptr) std::free(static_cast<void**>(ptr)[-1]);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+    if (ptr) std::free(static_cast<void**>(ptr)[-1]);
+}
+
+/**
+ * @brief 单项基准测试结果
+ */
+struct BenchResult {
+    std::string name;          ///< 用例名称
+    std::string format;        ///< 线上格式
+    std::string op;            ///< "encode"、"decode" 或 "decode_arena"
+    std::size_t payload_bytes; ///< 消息正文字节数
+    std::size_t wire_bytes;    ///< 编码后在线路上的字节数
+    double ns_per_op;          ///< 每次操作耗时（纳秒）
+    double allocs_per_op;      ///< 每次操作的堆分配次数
+    double alloc_bytes_per_op; ///< 每次操作的堆分配字节数
+
+    json to_json() const {
+        return {
+                {"name", name},
+                {"format", format},
+                {"op", op},
+                {"payload_bytes", payload_bytes},
+                {"wire_bytes", wire_bytes},
+                {"ns_per_op", ns_per_op},
+                {"allocs_per_op", allocs_per_op},
+                {"alloc_bytes_per_op", alloc_bytes_per_op}
+        };
+    }
+};
+
+/**
+ * @brief 防止编译器把基准循环中的结果优化掉
+ */
+static volatile std::size_t g_sink = 0;
+
+/**
+ * @brief 运行一个操作若干次并统计耗时与分配
+ * @param iterations 迭代次数
+ * @param op 被测操作，返回一个长度用于防优化
+ * @param result 写入 ns_per_op/allocs_per_op/alloc_bytes_per_op
+ */
+static void measure(std::size_t iterations, const std::function<std::size_t()>& op, BenchResult& result) {
+    // 预热，避免首次分配和缓存冷启动影响结果
+    for (std::size_t i = 0; i < iterations / 10 + 1; ++i) {
+        g_sink = g_sink + op();
+    }
+
+    std::size_t count_before = g_alloc_count.load(std::memory_order_relaxed);
+    std::size_t bytes_before = g_alloc_bytes.load(std::memory_order_relaxed);
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations; ++i) {
+        g_sink = g_sink + op();
+    }
+    auto end = std::chrono::steady_clock::now();
+    std::size_t count_after = g_alloc_count.load(std::memory_order_relaxed);
+    std::size_t bytes_after = g_alloc_bytes.load(std::memory_order_relaxed);
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    result.ns_per_op = static_cast<double>(elapsed) / static_cast<double>(iterations);
+    result.allocs_per_op = static_cast<double>(count_after - count_before) / static_cast<double>(iterations);
+    result.alloc_bytes_per_op = static_cast<double>(bytes_after - bytes_before) / static_cast<double>(iterations);
+}
+
+/**
+ * @brief 根据正文大小选择迭代次数，保证大消息的用例也能在合理时间内完成
+ */
+static std::size_t iterations_for(std::size_t payload_bytes) {
+    if (payload_bytes >= 16 * 1024) return 2000;
+    if (payload_bytes >= 1024) return 20000;
+    return 200000;
+}
+
+/**
+ * @brief 生成指定长度的消息正文，包含需要转义的字符以贴近真实粘贴内容
+ */
+static std::string make_payload(std::size_t size) {
+    static const std::string pattern = "hello, world! \"quoted\"\tline\n中文内容 ";
+    std::string payload;
+    payload.reserve(size + pattern.size());
+    while (payload.size() < size) {
+        payload += pattern;
+    }
+    payload.resize(size);
+    // 防止截断出半个 UTF-8 字符导致 dump 抛出异常
+    while (!payload.empty() && (static_cast<unsigned char>(payload.back()) & 0xC0) == 0x80) {
+        payload.pop_back();
+    }
+    if (!payload.empty() && (static_cast<unsigned char>(payload.back()) & 0x80)) {
+        payload.pop_back();
+    }
+    return payload;
+}
+
+/**
+ * @brief 对 RequestMessage 的 JSON 行格式进行编解码基准测试
+ */
+static void bench_request(const std::string& name, const RequestMessage& request, std::vector<BenchResult>& results) {
+    const std::string wire = encode_frame(request);
+    std::size_t iterations = iterations_for(request.content.size());
+
+    // 与客户端发送请求时的编码路径相同
+    BenchResult encode{name, "json_line", "encode", request.content.size(), wire.size()};
+    measure(iterations, [&request]() {
+        std::string frame = encode_frame(request);
+        return frame.size();
+    }, encode);
+    results.push_back(encode);
+
+    BenchResult decode{name, "json_line", "decode", request.content.size(), wire.size()};
+    measure(iterations, [&wire]() {
+        RequestMessage parsed = RequestMessage::from_json(json::parse(wire));
+        return parsed.content.size();
+    }, decode);
+    results.push_back(decode);
+
+    // 与服务器分发时相同：请求从单调缓冲区分配，缓冲区的内存来自复用的内存池
+    std::pmr::unsynchronized_pool_resource pool{std::pmr::pool_options{0, ClientSession::kPoolLargestBlock}};
+    BenchResult decode_arena{name, "json_line", "decode_arena", request.content.size(), wire.size()};
+    measure(iterations, [&wire, &pool]() {
+        std::pmr::monotonic_buffer_resource arena(ClientSession::kDispatchArenaSize, &pool);
+        RequestMessage parsed = RequestMessage::from_json(json::parse(wire), &arena);
+        return parsed.content.size();
+    }, decode_arena);
+    results.push_back(decode_arena);
+}
+
+/**
+ * @brief 对 ResponseMessage 的 JSON 行格式进行编解码基准测试
+ */
+static void bench_response(const std::string& name, const ResponseMessage& response, std::size_t payload_bytes,
+                           std::vector<BenchResult>& results) {
+    const std::string wire = encode_frame(response);
+    std::size_t iterations = iterations_for(payload_bytes);
+
+    // 与服务器 encode_response 未采样时的路径相同：编码后放入共享帧，供写队列和所有接收者持有
+    BenchResult encode{name, "json_line", "encode", payload_bytes, wire.size()};
+    measure(iterations, [&response]() {
+        auto frame = std::make_shared<const std::string>(encode_frame(response));
+        return frame->size();
+    }, encode);
+    results.push_back(encode);
+
+    BenchResult decode{name, "json_line", "decode", payload_bytes, wire.size()};
+    measure(iterations, [&wire]() {
+        ResponseMessage parsed = ResponseMessage::from_json(json::parse(wire));
+        return parsed.type.size();
+    }, decode);
+    results.push_back(decode);
+}
+
+/**
+ * @brief 对超过分块阈值的回复进行分块编码和客户端拼接解码的基准测试
+ *
+ * 编码与服务器发送大帧时相同：整帧序列化一次，再逐段封装成分块帧；
+ * 解码与客户端相同：逐个解析分块、拼接 data，最后一块到达后解析整帧。
+ * 耗时和分配按整条消息统计。
+ */
+static void bench_chunked(const std::string& name, const ResponseMessage& response, std::size_t payload_bytes,
+                          std::vector<BenchResult>& results) {
+    auto split = [](const ResponseMessage& message) {
+        std::string frame = encode_frame(message);
+        std::string_view content(frame);
+        content.remove_suffix(1);
+        std::vector<std::string> chunks;
+        std::size_t offset = 0;
+        for (std::uint32_t index = 0; offset < content.size(); ++index) {
+            chunks.push_back(encode_chunk(1, index, content, offset));
+        }
+        return chunks;
+    };
+    const std::vector<std::string> wire = split(response);
+    std::size_t wire_bytes = 0;
+    for (const auto& chunk : wire) {
+        wire_bytes += chunk.size();
+    }
+    std::size_t iterations = iterations_for(payload_bytes);
+
+    BenchResult encode{name, "json_line_chunked", "encode", payload_bytes, wire_bytes};
+    measure(iterations, [&response, &split]() {
+        return split(response).size();
+    }, encode);
+    results.push_back(encode);
+
+    BenchResult decode{name, "json_line_chunked", "decode", payload_bytes, wire_bytes};
+    measure(iterations, [&wire]() {
+        std::string frame;
+        for (const auto& chunk : wire) {
+            json parsed = json::parse(chunk);
+            frame += parsed.at("content").at("data").get<std::string>();
+        }
+        ResponseMessage message = ResponseMessage::from_json(json::parse(frame));
+        return message.type.size();
+    }, decode);
+    results.push_back(decode);
+}
+
+/**
+ * @brief 对广播微批拼接块进行编码和客户端按行解码的基准测试
+ *
+ * 编码与服务器批量窗口到期时相同：逐条序列化广播，再拼接成一块共享帧；
+ * 解码与客户端相同：按换行切分，逐行解析。耗时和分配按整块统计。
+ * @param frames 一块中的广播条数，整块不应超过分块阈值
+ */
+static void bench_batched(const std::string& name, const ResponseMessage& response, std::size_t payload_bytes,
+                          std::size_t frames, std::vector<BenchResult>& results) {
+    auto combine = [frames](const ResponseMessage& message) {
+        std::vector<std::shared_ptr<const std::string>> batch;
+        std::size_t bytes = 0;
+        for (std::size_t i = 0; i < frames; ++i) {
+            batch.push_back(std::make_shared<const std::string>(encode_frame(message)));
+            bytes += batch.back()->size();
+        }
+        auto combined = std::make_shared<std::string>();
+        combined->reserve(bytes);
+        for (const auto& frame : batch) {
+            combined->append(*frame);
+        }
+        return combined;
+    };
+    const std::string wire = *combine(response);
+    std::size_t iterations = iterations_for(payload_bytes * frames);
+
+    BenchResult encode{name, "json_line_batched", "encode", payload_bytes * frames, wire.size()};
+    measure(iterations, [&response, &combine]() {
+        return combine(response)->size();
+    }, encode);
+    results.push_back(encode);
+
+    BenchResult decode{name, "json_line_batched", "decode", payload_bytes * frames, wire.size()};
+    measure(iterations, [&wire]() {
+        std::size_t parsed_frames = 0;
+        std::size_t begin = 0;
+        std::size_t end;
+        while ((end = wire.find('\n', begin)) != std::string::npos) {
+            ResponseMessage message = ResponseMessage::from_json(
+                    json::parse(std::string_view(wire).substr(begin, end - begin)));
+            parsed_frames += message.type.size();
+            begin = end + 1;
+        }
+        return parsed_frames;
+    }, decode);
+    results.push_back(decode);
+}
+
+/**
+ * @brief 序列化层微基准：测量 RequestMessage/ResponseMessage 的编解码耗时、线路字节数和堆分配
+ *
+ * 每个用例输出一行 JSON，便于脚本对比不同编解码实现的结果。
+ * 传入 --pretty 时输出一个格式化的 JSON 数组。
+ */
+int main(int argc, char** argv) {
+    bool pretty = argc > 1 && std::string(argv[1]) == "--pretty";
+    std::vector<BenchResult> results;
+
+    // 控制类消息
+    bench_request("request_connect", {"connect", "Alice", "", ""}, results);
+    bench_request("request_get_channel_list", {"get_channel_list", "Alice", "", ""}, results);
+    bench_request("request_join_channel", {"join_channel", "Alice", "General", ""}, results);
+    bench_response("response_connect", {"connect", "success", "Username registered"}, 0, results);
+    bench_response("response_channel_list", {"channel_list", "success", json({"SciFi", "Tech", "General"})}, 0,
+                   results);
+
+    // 聊天消息：从一行短消息到 64 KiB 的粘贴
+    const std::vector<std::size_t> payload_sizes = {16, 256, 4 * 1024, 64 * 1024};
+    for (std::size_t size : payload_sizes) {
+        std::string payload = make_payload(size);
+        std::string suffix = "_" + std::to_string(size);
+
+        bench_request("request_send_message" + suffix, {"send_message", "Alice", "General", payload}, results);
+
+        ResponseMessage broadcast = {"send_message", "success",
+                                     {{"sender", "Alice"}, {"channel", "General"}, {"content", payload}}};
+        bench_response("response_send_message" + suffix, broadcast, payload.size(), results);
+        if (size > kChunkThreshold) {
+            // 超过分块阈值的广播实际以分块帧发送
+            bench_chunked("response_send_message" + suffix, broadcast, payload.size(), results);
+        } else if (size <= 256) {
+            // 批量窗口内的短广播拼接成一块发送，8 条远小于分块阈值
+            bench_batched("response_send_message" + suffix + "_x8", broadcast, payload.size(), 8, results);
+        }
+    }
+
+    if (pretty) {
+        json output = json::array();
+        for (const auto& result : results) {
+            output.push_back(result.to_json());
+        }
+        std::cout << output.dump(2) << std::endl;
+    } else {
+        for (const auto& result : results) {
+            std::cout << result.to_json().dump() << "\n";
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,377 @@
+//
+// Created by 穆琰鑫 on 2024/10/26.
+//
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "../include/LatencyTrace.h"
+#include "../include/TrafficCapture.h"
+
+using tcp = boost::asio::ip::tcp;
+using error_code = boost::system::error_code;
+using json = nlohmann::json;
+
+/**
+ * @brief 回放参数
+ */
+struct ReplayOptions {
+    std::string capture_path;      ///< 抓包文件路径
+    std::string host = "127.0.0.1";///< 被测服务器地址
+    std::string port = "12345";    ///< 被测服务器端口
+    double speed = 1.0;            ///< 回放倍速，0 表示不等待、尽快发送
+    int drain_ms = 1000;           ///< 发送完毕后连续多久没有收到数据即结束
+    bool pretty = false;           ///< 是否格式化输出
+    bool trace = false;            ///< 是否给请求附加追踪时间戳以统计延迟，开启后服务器走追踪路径
+};
+
+/**
+ * @brief 预处理后的一条回放记录
+ */
+struct ReplayEvent {
+    std::int64_t offset_ns = 0;    ///< 距抓包开始的时间
+    std::uint32_t session_id = 0;  ///< 抓包中的会话编号
+    CaptureRecord::Kind kind = CaptureRecord::frame; ///< 记录类型
+    json request;                  ///< 开启追踪时解析出的请求，否则或解析失败时为 null
+    std::string raw;               ///< 原始帧，不追踪或解析失败时原样发送
+};
+
+/**
+ * @brief 回放中的一个客户端连接，对应抓包中的一个会话
+ */
+struct ReplayConnection {
+    explicit ReplayConnection(boost::asio::io_context& io_context) : socket(io_context) {}
+
+    tcp::socket socket;                    ///< 到被测服务器的连接
+    std::string read_buffer;               ///< 读缓冲
+    std::deque<std::string> write_queue;   ///< 待发送的帧，连接建立前先排队
+    bool connected = false;                ///< 连接是否已建立
+    bool failed = false;                   ///< 连接失败，之后的帧直接丢弃
+    bool writing = false;                  ///< 是否有异步写正在进行
+    bool closing = false;                  ///< 抓包中会话已断开，写队列发送完后关闭发送方向
+    std::unordered_map<std::uint32_t, std::string> pending_chunks; ///< 正在拼接的分块回复
+};
+
+/**
+ * @brief 按抓包中的时间间隔向本地服务器重放入站流量，统计延迟与吞吐
+ *
+ * 每个会话在抓包记录的建立时间发起连接，没有建立记录的旧抓包在会话第一条记录时连接。
+ * 开启追踪时每个请求附加追踪时间戳，服务器会把它带回到回复和广播中，
+ * 收到时用同一单调时钟相减即得请求到回复（或到广播送达）的延迟，按回复类型分别统计。
+ */
+class Replayer {
+public:
+    explicit Replayer(ReplayOptions options) : options_(std::move(options)), timer_(io_context_) {}
+
+    /**
+     * @brief 读取并预解析抓包文件
+     */
+    void load() {
+        CaptureReader reader(options_.capture_path);
+        CaptureRecord record;
+        while (reader.next(record)) {
+            ReplayEvent event;
+            event.offset_ns = record.offset_ns;
+            event.session_id = record.session_id;
+            event.kind = record.kind;
+            if (record.kind == CaptureRecord::frame) {
+                if (options_.trace) {
+                    event.request = json::parse(record.data, nullptr, false);
+                    if (event.request.is_discarded() || !event.request.is_object()) {
+                        event.request = nullptr;
+                    }
+                }
+                event.raw = std::move(record.data);
+            }
+            events_.push_back(std::move(event));
+        }
+    }
+
+    /**
+     * @brief 按时间重放连接和请求，直到服务器不再发送数据
+     */
+    void run() {
+        tcp::resolver resolver(io_context_);
+        endpoints_ = resolver.resolve(options_.host, options_.port);
+
+        start_ns_ = monotonic_now_ns();
+        send_due_events();
+        io_context_.run();
+    }
+
+    /**
+     * @brief 导出统计结果
+     */
+    json report() const {
+        double send_seconds = static_cast<double>(last_send_ns_ - start_ns_) / 1e9;
+        double receive_seconds = static_cast<double>(last_receive_ns_ - start_ns_) / 1e9;
+        json latency = json::object();
+        for (const auto& [type, histogram] : latency_) {
+            latency[type] = histogram.to_json();
+        }
+        return {
+                {"capture", options_.capture_path},
+                {"speed", options_.speed},
+                {"sessions", connections_.size()},
+                {"connect_failures", connect_failures_},
+                {"frames_sent", frames_sent_},
+                {"bytes_sent", bytes_sent_},
+                {"frames_received", frames_received_},
+                {"bytes_received", bytes_received_},
+                {"send_seconds", send_seconds},
+                {"send_fps", send_seconds > 0 ? static_cast<double>(frames_sent_) / send_seconds : 0.0},
+                {"receive_fps", receive_seconds > 0 ? static_cast<double>(frames_received_) / receive_seconds : 0.0},
+                {"schedule_lag", schedule_lag_.to_json()},
+                {"latency", latency}
+        };
+    }
+
+private:
+    /**
+     * @brief 发送所有已到时间的记录，然后等待下一条记录的时间
+     */
+    void send_due_events() {
+        while (next_event_ < events_.size()) {
+            const ReplayEvent& event = events_[next_event_];
+            std::int64_t due_ns = start_ns_;
+            if (options_.speed > 0) {
+                due_ns += static_cast<std::int64_t>(static_cast<double>(event.offset_ns) / options_.speed);
+            }
+            std::int64_t now_ns = monotonic_now_ns();
+            if (due_ns > now_ns) {
+                timer_.expires_after(std::chrono::nanoseconds(due_ns - now_ns));
+                timer_.async_wait([this](error_code ec) {
+                    if (!ec) send_due_events();
+                });
+                return;
+            }
+            schedule_lag_.record(now_ns - due_ns);
+            replay(event);
+            ++next_event_;
+        }
+        last_send_ns_ = monotonic_now_ns();
+        wait_for_drain(frames_received_);
+    }
+
+    /**
+     * @brief 重放一条记录
+     */
+    void replay(const ReplayEvent& event) {
+        auto& connection = connections_[event.session_id];
+        if (!connection) {
+            connect(connection);
+        }
+        if (event.kind == CaptureRecord::open) {
+            return;
+        }
+        if (event.kind == CaptureRecord::close) {
+            // 只关闭发送方向，服务器同样看到断开，已发出请求的回复仍可统计
+            connection->closing = true;
+            pump_writes(connection);
+            return;
+        }
+
+        std::string frame;
+        if (options_.trace && event.request.is_object()) {
+            json request = event.request;
+            request["trace"] = {{"id", ++next_trace_id_}, {"client", "replay"},
+                                {"client_send_ns", monotonic_now_ns()}};
+            frame = request.dump() + "\n";
+        } else {
+            frame = event.raw;
+        }
+        ++frames_sent_;
+        bytes_sent_ += frame.size();
+        connection->write_queue.push_back(std::move(frame));
+        pump_writes(connection);
+    }
+
+    /**
+     * @brief 为会话发起异步连接，建立后开始读取并发送已排队的帧
+     * @param connection 输出的新连接
+     */
+    void connect(std::shared_ptr<ReplayConnection>& connection) {
+        connection = std::make_shared<ReplayConnection>(io_context_);
+        boost::asio::async_connect(connection->socket, endpoints_,
+                                   [this, connection](error_code ec, const tcp::endpoint&) {
+            if (ec) {
+                ++connect_failures_;
+                connection->failed = true;
+                connection->write_queue.clear();
+                return;
+            }
+            connection->connected = true;
+            error_code ignored;
+            connection->socket.set_option(tcp::no_delay(true), ignored);
+            start_reading(connection);
+            pump_writes(connection);
+        });
+    }
+
+    /**
+     * @brief 依次发送连接写队列中的帧
+     */
+    void pump_writes(const std::shared_ptr<ReplayConnection>& connection) {
+        if (connection->failed) {
+            connection->write_queue.clear();
+            return;
+        }
+        if (!connection->connected || connection->writing) return;
+        if (connection->write_queue.empty()) {
+            if (connection->closing) {
+                connection->closing = false;
+                error_code ignored;
+                connection->socket.shutdown(tcp::socket::shutdown_send, ignored);
+            }
+            return;
+        }
+        connection->writing = true;
+        boost::asio::async_write(connection->socket, boost::asio::buffer(connection->write_queue.front()),
+                                 [this, connection](error_code ec, std::size_t) {
+            connection->writing = false;
+            connection->write_queue.pop_front();
+            if (ec) {
+                connection->write_queue.clear();
+                return;
+            }
+            pump_writes(connection);
+        });
+    }
+
+    /**
+     * @brief 持续读取服务器发来的帧
+     */
+    void start_reading(const std::shared_ptr<ReplayConnection>& connection) {
+        boost::asio::async_read_until(connection->socket, boost::asio::dynamic_buffer(connection->read_buffer), "\n",
+                                      [this, connection](error_code ec, std::size_t length) {
+            if (ec) return;
+            std::int64_t received_ns = monotonic_now_ns();
+            std::string data(connection->read_buffer.substr(0, length));
+            connection->read_buffer.erase(0, length);
+            ++frames_received_;
+            bytes_received_ += data.size();
+            last_receive_ns_ = received_ns;
+            handle_frame(*connection, json::parse(data, nullptr, false), received_ns);
+            start_reading(connection);
+        });
+    }
+
+    /**
+     * @brief 拼接分块回复，并按回复类型记录追踪延迟
+     */
+    void handle_frame(ReplayConnection& connection, const json& response, std::int64_t received_ns) {
+        if (!response.is_object()) return;
+        std::string type = response.value("type", "");
+        if (type == "chunk") {
+            const json& chunk = response.at("content");
+            auto id = chunk.at("id").get<std::uint32_t>();
+            std::string& frame = connection.pending_chunks[id];
+            frame += chunk.at("data").get<std::string>();
+            if (chunk.at("last").get<bool>()) {
+                json assembled = json::parse(frame, nullptr, false);
+                connection.pending_chunks.erase(id);
+                handle_frame(connection, assembled, received_ns);
+            }
+            return;
+        }
+        const json* trace = response.contains("trace") ? &response.at("trace") : nullptr;
+        if (trace && trace->is_object() && trace->value("client", "") == "replay" && trace->contains("client_send_ns")) {
+            latency_[type].record(received_ns - trace->at("client_send_ns").get<std::int64_t>());
+        }
+    }
+
+    /**
+     * @brief 发送完毕后，等到一个周期内不再收到数据时结束回放
+     * @param received_before 上个周期结束时已收到的帧数
+     */
+    void wait_for_drain(std::uint64_t received_before) {
+        timer_.expires_after(std::chrono::milliseconds(options_.drain_ms));
+        timer_.async_wait([this, received_before](error_code ec) {
+            if (ec) return;
+            if (frames_received_ != received_before) {
+                wait_for_drain(frames_received_);
+                return;
+            }
+            for (auto& [id, connection] : connections_) {
+                error_code ignored;
+                connection->socket.close(ignored);
+            }
+            io_context_.stop();
+        });
+    }
+
+    ReplayOptions options_;
+    boost::asio::io_context io_context_;
+    boost::asio::steady_timer timer_;      ///< 发送节奏和结束判定的定时器
+    std::vector<ReplayEvent> events_;      ///< 按时间排序的回放记录
+    std::size_t next_event_ = 0;           ///< 下一条待发送的记录
+    std::map<std::uint32_t, std::shared_ptr<ReplayConnection>> connections_; ///< 会话编号到连接的映射
+    tcp::resolver::results_type endpoints_; ///< 被测服务器地址
+    std::uint64_t connect_failures_ = 0;   ///< 连接失败的会话数
+
+    std::int64_t start_ns_ = 0;            ///< 回放开始的单调时间
+    std::int64_t last_send_ns_ = 0;        ///< 最后一条记录发送的时间
+    std::int64_t last_receive_ns_ = 0;     ///< 最后一次收到数据的时间
+    std::uint64_t next_trace_id_ = 0;      ///< 追踪编号
+    std::uint64_t frames_sent_ = 0;
+    std::uint64_t bytes_sent_ = 0;
+    std::uint64_t frames_received_ = 0;
+    std::uint64_t bytes_received_ = 0;
+    LatencyHistogram schedule_lag_;        ///< 实际发送时间相对计划时间的滞后
+    std::map<std::string, LatencyHistogram> latency_; ///< 按回复类型统计的延迟
+};
+
+/**
+ * @brief 回放入口
+ *
+ * 用法: traffic_replay <capture> [--host <host>] [--port <port>] [--speed <x>] [--drain-ms <ms>] [--trace] [--pretty]
+ * --speed 1 按抓包时的节奏回放，--speed 10 加速 10 倍，--speed 0 不等待、尽快发送。
+ * 每个会话在抓包中的建立时间发起一条连接，结束后输出一行 JSON 统计：发送/接收帧数与吞吐、调度滞后；
+ * 加 --trace 时给请求附加追踪时间戳，另外输出按回复类型的延迟直方图
+ * （send_message 为广播送达延迟，其余为请求到回复的延迟），服务器会因此走追踪路径。
+ * 服务器应使用与抓包时相同的频道配置，并从空的历史数据库开始，结果才可重复。
+ */
+int main(int argc, char** argv) {
+    ReplayOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--host" && i + 1 < argc) {
+            options.host = argv[++i];
+        } else if (arg == "--port" && i + 1 < argc) {
+            options.port = argv[++i];
+        } else if (arg == "--speed" && i + 1 < argc) {
+            options.speed = std::stod(argv[++i]);
+        } else if (arg == "--drain-ms" && i + 1 < argc) {
+            options.drain_ms = std::stoi(argv[++i]);
+        } else if (arg == "--trace") {
+            options.trace = true;
+        } else if (arg == "--pretty") {
+            options.pretty = true;
+        } else {
+            options.capture_path = arg;
+        }
+    }
+    if (options.capture_path.empty()) {
+        std::cerr << "usage: traffic_replay <capture> [--host <host>] [--port <port>] [--speed <x>] "
+                     "[--drain-ms <ms>] [--trace] [--pretty]" << std::endl;
+        return 1;
+    }
+
+    try {
+        Replayer replayer(options);
+        replayer.load();
+        replayer.run();
+        std::cout << replayer.report().dump(options.pretty ? 2 : -1) << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Replay error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
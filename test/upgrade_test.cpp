@@ -0,0 +1,185 @@
+//
+// Created by 穆琰鑫 on 2024/10/28.
+//
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
+#include <nlohmann/json.hpp>
+#include "../include/NetWork.h"
+
+/**
+ * @file upgrade_test.cpp
+ * @brief 平滑升级接管测试
+ *
+ * 在同一进程中先后启动旧服务器和接管的新服务器，客户端在移交前只发出半个请求，
+ * 且在一个多字节 UTF-8 字符中间截断，检查新服务器能拼接出完整请求并正常广播；
+ * 移交开始时发出的历史和搜索请求也都要收到回复。
+ * 用法: upgrade_test [port]，全部检查通过时返回 0。
+ */
+
+namespace {
+
+/**
+ * @brief 同步收发的测试客户端，读取带超时
+ */
+struct TestClient {
+    boost::asio::io_context io;
+    tcp::socket socket{io};
+    std::string buffer;
+
+    /**
+     * @brief 发送原始字节
+     */
+    void send(std::string_view bytes) {
+        boost::asio::write(socket, boost::asio::buffer(bytes.data(), bytes.size()));
+    }
+
+    /**
+     * @brief 读取下一帧，超时或连接断开时返回空
+     */
+    std::optional<json> read_frame(std::chrono::milliseconds timeout) {
+        std::optional<json> frame;
+        boost::asio::async_read_until(socket, boost::asio::dynamic_buffer(buffer), '\n',
+                                      [this, &frame](error_code ec, std::size_t length) {
+            if (!ec) {
+                frame = json::parse(buffer.substr(0, length));
+                buffer.erase(0, length);
+            }
+        });
+        io.restart();
+        io.run_for(timeout);
+        if (!io.stopped()) {
+            // 超时，取消读并等待回调结束
+            error_code ignored;
+            socket.cancel(ignored);
+            io.restart();
+            io.run();
+        }
+        return frame;
+    }
+
+    /**
+     * @brief 跳过其他帧，直到读到指定类型的帧
+     */
+    std::optional<json> expect(const std::string& type, std::chrono::milliseconds timeout = std::chrono::seconds(5)) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (std::chrono::steady_clock::now() < deadline) {
+            auto frame = read_frame(std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()));
+            if (!frame) break;
+            if (frame->value("type", "") == type) return frame;
+        }
+        return std::nullopt;
+    }
+};
+
+int failures = 0;
+
+/**
+ * @brief 打印一项检查的结果
+ */
+void check(bool passed, const std::string& what) {
+    std::cout << (passed ? "[PASS] " : "[FAIL] ") << what << std::endl;
+    if (!passed) ++failures;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+#ifdef HACK_CHAT_HAS_UPGRADE_HANDOFF
+    short port = argc > 1 ? static_cast<short>(std::stoi(argv[1])) : 12399;
+    auto temp_dir = std::filesystem::temp_directory_path();
+    std::string upgrade_path = (temp_dir / "hack_chat_upgrade_test.sock").string();
+    std::string history_path = (temp_dir / "hack_chat_upgrade_test.db").string();
+    for (const char* suffix : {"", "-wal", "-shm"}) {
+        std::filesystem::remove(history_path + suffix);
+    }
+
+    try {
+        auto old_server = std::make_unique<ServerNetwork>(port, std::vector<std::string>{"General"});
+        old_server->enable_history(history_path);
+        if (!old_server->enable_upgrade(upgrade_path)) {
+            std::cerr << "Failed to listen on " << upgrade_path << std::endl;
+            return 1;
+        }
+        std::thread old_thread([&old_server]() { old_server->run_server(); });
+
+        TestClient client;
+        client.socket.connect(tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), port));
+        client.send(R"({"type":"connect","username":"alice","channel":"","content":""})" "\n");
+        check(client.expect("connect").has_value(), "connect before handoff");
+        client.send(R"({"type":"join_channel","username":"alice","channel":"General","content":""})" "\n");
+        check(client.expect("join_channel").has_value(), "join before handoff");
+
+        // 只发出请求的前半部分，在“升”字的第一个字节之后截断
+        const std::string content = "平滑升级";
+        std::string request = json{{"type", "send_message"}, {"username", "alice"}, {"channel", "General"},
+                                   {"content", content}}.dump() + "\n";
+        std::size_t cut = request.find("升") + 1;
+        client.send(std::string_view(request).substr(0, cut));
+        // 等旧服务器把这些字节读入会话的读缓冲
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        // 移交开始的同时发出请求的后半部分和一批历史、搜索请求，
+        // 旧服务器可能已经读到这些请求，而回复还在后台线程中查询
+        constexpr int history_requests = 20;
+        std::string burst = request.substr(cut);
+        for (int i = 0; i < history_requests; ++i) {
+            burst += R"({"type":"get_history","username":"alice","channel":"General","content":"","after_seq":0})" "\n";
+            burst += R"({"type":"search","username":"alice","channel":"General","content":"平滑升级"})" "\n";
+        }
+
+        std::unique_ptr<ServerNetwork> new_server;
+        std::thread takeover_thread([&]() {
+            // 构造函数在旧服务器发出状态后返回，旧服务器随后退出事件循环
+            new_server = std::make_unique<ServerNetwork>(upgrade_path);
+        });
+        client.send(burst);
+        takeover_thread.join();
+        old_thread.join();
+        old_server.reset();
+        check(true, "takeover with a partial UTF-8 character pending");
+        std::thread new_thread([&new_server]() { new_server->run_server(); });
+
+        bool delivered = false;
+        int histories = 0;
+        int searches = 0;
+        while (!delivered || histories < history_requests || searches < history_requests) {
+            auto frame = client.read_frame(std::chrono::seconds(10));
+            if (!frame) break;
+            std::string type = frame->value("type", "");
+            if (type == "send_message") {
+                delivered = frame->at("content").value("content", "") == content;
+            } else if (type == "history") {
+                ++histories;
+            } else if (type == "search_result") {
+                ++searches;
+            }
+        }
+        check(delivered, "request split across the handoff is delivered intact");
+        check(histories == history_requests, "every get_history sent during the handoff is answered");
+        check(searches == history_requests, "every search sent during the handoff is answered");
+
+        new_server->stop();
+        new_thread.join();
+    } catch (const std::exception& e) {
+        std::cerr << "Upgrade test error: " << e.what() << std::endl;
+        ++failures;
+    }
+
+    for (const char* suffix : {"", "-wal", "-shm"}) {
+        std::filesystem::remove(history_path + suffix);
+    }
+    std::cout << (failures == 0 ? "All upgrade checks passed" : "Some upgrade checks failed") << std::endl;
+    return failures == 0 ? 0 : 1;
+#else
+    std::cout << "Graceful upgrade is not supported on this platform, skipping." << std::endl;
+    return 0;
+#endif
+}